@@ -0,0 +1,423 @@
+#include "my_io.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Batch reads: many files read whole through one ring, BATCH_CHUNK at a time
+ * with up to depth reads in flight. Whenever a slot frees up the policy picks
+ * the file that issues the next chunk:
+ *
+ *  - MY_SCHED_FIFO: the first file added that still has bytes to ask for.
+ *  - MY_SCHED_SJF: the file with the fewest bytes left to ask for, so small
+ *    files are not stuck behind big ones. A file earns BATCH_AGING bytes of
+ *    head start for every second it has waited for a read, so a big file
+ *    still gets its turn while small ones keep coming.
+ *  - MY_SCHED_DEADLINE: the earliest deadline. Files without one are due
+ *    BATCH_LAX after the batch starts, which ages them the same way.
+ *  - MY_SCHED_WRR: weighted round-robin over the files still being read.
+ *    Each turn a file issues as many chunks as its priority class weighs,
+ *    and it never holds more than its weight's share of the slots, so an
+ *    interactive file keeps getting slots while bulk files are read.
+ *
+ * Every read carries its file's priority class in sqe->ioprio. Each file is
+ * handed to the callback as soon as its last chunk is in.
+ *
+ * The policies work from the sizes stat(2) reports. A file is opened and
+ * its buffer allocated only when it is first picked, and no more than depth
+ * files are open at once. Descriptors and memory therefore follow the reads
+ * in flight, not the size of the batch.
+ */
+#define BATCH_CHUNK (128 * 1024)
+#define BATCH_AGING (64.0 * 1024 * 1024)
+#define BATCH_LAX 0.1
+#define BATCH_CANCEL (~0ull) // user_data of the cancel when stopped early
+
+// MY_SCHED_WRR weights by priority class; no class weighs as best-effort.
+static const unsigned batch_weight[] = {4, 8, 4, 1};
+
+struct batch_file {
+  const char *name;
+  int fd;
+  off_t size;
+  char *data;
+  off_t issued; // Bytes asked for
+  off_t done;   // and read
+  int inflight;
+  int err;
+  bool finished;
+  double deadline; // Seconds from the start of the batch, 0 for none
+  double waiting;  // Since it last issued a read
+  double sec;      // Completion time
+  int prio;
+  unsigned short ioprio;
+  unsigned credit; // MY_SCHED_WRR: chunks left in its turn
+};
+
+struct batch_read {
+  int file;
+  off_t off;
+  unsigned len;
+  unsigned got;
+};
+
+struct my_batch {
+  int policy;
+  unsigned depth;
+  unsigned open; // Files open, at most depth
+  size_t rr;     // MY_SCHED_WRR: whose turn it is
+  std::vector<batch_file> files;
+  my_sched_stats stats;
+};
+
+static double batch_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+const char *my_sched_name(int policy) {
+  switch (policy) {
+  case MY_SCHED_FIFO:
+    return "fifo";
+  case MY_SCHED_SJF:
+    return "sjf";
+  case MY_SCHED_DEADLINE:
+    return "deadline";
+  case MY_SCHED_WRR:
+    return "wrr";
+  }
+  return "?";
+}
+
+my_batch *my_batch_open(int policy, unsigned depth) {
+  if (policy < MY_SCHED_FIFO || policy > MY_SCHED_WRR) {
+    errno = EINVAL;
+    return NULL;
+  }
+  my_batch *b = new my_batch();
+  b->policy = policy;
+  b->depth = depth ? depth : BATCH_DEPTH;
+  return b;
+}
+
+// Queue filename. deadline_sec counts from my_batch_run(), 0 for none.
+int my_batch_add(my_batch *b, const char *filename, double deadline_sec) {
+  batch_file f = batch_file();
+  f.name = filename;
+  f.fd = -1;
+  f.deadline = deadline_sec;
+  b->files.push_back(f);
+  return (int)b->files.size() - 1;
+}
+
+// Priority class of a file's reads, MY_PRIO_NONE by default.
+int my_batch_prio(my_batch *b, int file, int prio) {
+  if (file < 0 || file >= (int)b->files.size() || prio < MY_PRIO_NONE ||
+      prio > MY_PRIO_IDLE) {
+    errno = EINVAL;
+    return -1;
+  }
+  b->files[file].prio = prio;
+  return 0;
+}
+
+// Whether f has a chunk to ask for; a file not yet open needs room to open.
+static bool batch_wants(my_batch *b, batch_file *f) {
+  return !f->err && !f->finished && f->issued < f->size &&
+         (f->fd >= 0 || b->open < b->depth);
+}
+
+// The next file in turn with credit and room under its share of the slots.
+// When no file has credit left a new round starts.
+static int batch_pick_wrr(my_batch *b) {
+  size_t n = b->files.size();
+  unsigned total = 0;
+  for (size_t i = 0; i < n; i++)
+    if (batch_wants(b, &b->files[i]))
+      total += batch_weight[b->files[i].prio];
+  for (int round = 0; total && round < 2; round++) {
+    for (size_t k = 0; k < n; k++) {
+      size_t i = (b->rr + k) % n;
+      batch_file *f = &b->files[i];
+      unsigned share = b->depth * batch_weight[f->prio] / total;
+      if (!batch_wants(b, f) || !f->credit ||
+          f->inflight >= (int)(share ? share : 1))
+        continue;
+      f->credit--;
+      b->rr = f->credit ? i : i + 1;
+      return i;
+    }
+    for (size_t i = 0; i < n; i++)
+      b->files[i].credit = batch_weight[b->files[i].prio];
+  }
+  return -1;
+}
+
+// The file to ask for the next chunk, or -1.
+static int batch_pick(my_batch *b, double now) {
+  if (b->policy == MY_SCHED_WRR)
+    return batch_pick_wrr(b);
+  int best = -1;
+  double best_key = 0;
+  for (size_t i = 0; i < b->files.size(); i++) {
+    batch_file *f = &b->files[i];
+    if (!batch_wants(b, f))
+      continue;
+    double key;
+    if (b->policy == MY_SCHED_FIFO)
+      return i;
+    else if (b->policy == MY_SCHED_SJF)
+      key = (f->size - f->issued) / BATCH_AGING - (now - f->waiting);
+    else
+      key = f->deadline > 0 ? f->deadline : BATCH_LAX;
+    if (best < 0 || key < best_key) {
+      best = i;
+      best_key = key;
+    }
+  }
+  return best;
+}
+
+// Open a file picked for the first time and allocate its buffer.
+static int batch_open_file(my_batch *b, batch_file *f) {
+  f->fd = open(f->name, O_RDONLY);
+  if (f->fd < 0) {
+    f->err = errno;
+    return -1;
+  }
+  b->open++;
+  off_t size = get_file_size(f->fd);
+  if (size < 0) {
+    f->err = errno ? errno : EIO;
+    return -1;
+  }
+  f->size = size; // It may have changed since the stat
+  if (!(f->data = static_cast<char *>(malloc(f->size ? f->size : 1)))) {
+    f->err = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+static int batch_prep(struct submitter *s, batch_file *f, batch_read *r,
+                      int slot) {
+  struct io_uring_sqe *sqe = app_get_sqe(s);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_READ;
+  sqe->ioprio = f->ioprio;
+  sqe->fd = f->fd;
+  sqe->addr = (unsigned long)(f->data + r->off + r->got);
+  sqe->len = r->len - r->got;
+  sqe->off = r->off + r->got;
+  sqe->user_data = slot;
+  return 0;
+}
+
+// Hand a file that is done with to the callback and let go of it.
+static int batch_finish(my_batch *b, int i, double sec, my_batch_fn fn,
+                        void *arg) {
+  batch_file *f = &b->files[i];
+  f->finished = true;
+  f->sec = sec;
+  int ret = fn(i, f->data ? f->data : "", f->err ? -f->err : f->size, arg);
+  if (f->fd >= 0) {
+    close(f->fd);
+    b->open--;
+  }
+  f->fd = -1;
+  free(f->data);
+  f->data = NULL;
+  return ret;
+}
+
+static void batch_count(my_batch *b, double total) {
+  my_sched_stats *st = &b->stats;
+  std::vector<double> secs;
+  size_t by_prio[MY_PRIO_IDLE + 1] = {0};
+  *st = my_sched_stats();
+  for (size_t i = 0; i < b->files.size(); i++) {
+    batch_file *f = &b->files[i];
+    if (!f->finished)
+      continue;
+    if (f->err) {
+      st->failed++;
+      continue;
+    }
+    st->files++;
+    st->bytes += f->size;
+    if (f->deadline > 0 && f->sec > f->deadline)
+      st->missed++;
+    secs.push_back(f->sec);
+    st->prio_mean_sec[f->prio] += f->sec;
+    by_prio[f->prio]++;
+  }
+  for (int p = MY_PRIO_NONE; p <= MY_PRIO_IDLE; p++)
+    if (by_prio[p])
+      st->prio_mean_sec[p] /= by_prio[p];
+  if (!secs.empty()) {
+    std::sort(secs.begin(), secs.end());
+    double sum = 0;
+    for (size_t i = 0; i < secs.size(); i++)
+      sum += secs[i];
+    st->mean_sec = sum / secs.size();
+    st->p95_sec = secs[(secs.size() - 1) * 95 / 100];
+    st->max_sec = secs.back();
+  }
+  st->total_sec = total;
+}
+
+/*
+ * Read every file added, calling fn(i, data, len, arg) as each one is done.
+ * data is valid until fn returns; len is -errno for a file that could not be
+ * read. fn returning non-zero stops the batch.
+ */
+int my_batch_run(my_batch *b, my_batch_fn fn, void *arg) {
+  struct submitter s;
+  if (app_setup_uring_ex(&s, b->depth, 0))
+    return -1;
+  std::vector<batch_read> reads(b->depth);
+  std::vector<int> free_slots;
+  for (int i = b->depth - 1; i >= 0; i--)
+    free_slots.push_back(i);
+
+  double start = batch_now();
+  size_t left = b->files.size();
+  b->rr = 0;
+  b->open = 0;
+  int ret = 0;
+  for (size_t i = 0; i < b->files.size(); i++) {
+    batch_file *f = &b->files[i];
+    struct stat st;
+    f->waiting = 0;
+    f->ioprio = my_ioprio(f->prio);
+    f->credit = 0;
+    if (stat(f->name, &st) < 0)
+      f->err = errno;
+    else
+      f->size = S_ISBLK(st.st_mode) ? 1 : st.st_size; // Sized once open
+    if (f->err || f->size == 0) {
+      left--;
+      if (batch_finish(b, i, 0, fn, arg))
+        ret = 1;
+    }
+  }
+
+  int inflight = 0;
+  while (left > 0 && !ret) {
+    double now = batch_now() - start;
+    int i;
+    while (!ret && !free_slots.empty() && (i = batch_pick(b, now)) >= 0) {
+      batch_file *f = &b->files[i];
+      if (f->fd < 0 && batch_open_file(b, f) < 0) {
+        left--;
+        if (batch_finish(b, i, now, fn, arg))
+          ret = 1;
+        continue;
+      }
+      if (f->size == 0) { // It shrank to nothing since the stat
+        left--;
+        if (batch_finish(b, i, now, fn, arg))
+          ret = 1;
+        continue;
+      }
+      int slot = free_slots.back();
+      free_slots.pop_back();
+      batch_read *r = &reads[slot];
+      r->file = i;
+      r->off = f->issued;
+      r->len = f->size - f->issued < BATCH_CHUNK ? f->size - f->issued
+                                                 : BATCH_CHUNK;
+      r->got = 0;
+      if (batch_prep(&s, f, r, slot) < 0) {
+        free_slots.push_back(slot);
+        ret = -1;
+        break;
+      }
+      f->issued += r->len;
+      f->inflight++;
+      f->waiting = now;
+      inflight++;
+    }
+    if (inflight == 0 || ret)
+      break;
+
+    struct io_uring_cqe *cqe;
+    if (app_submit_and_wait(&s, 1) < 0 || app_wait_cqe(&s, &cqe) < 0) {
+      ret = -1;
+      break;
+    }
+    do {
+      int slot = (int)cqe->user_data;
+      int res = cqe->res;
+      app_cqe_seen(&s);
+      batch_read *r = &reads[slot];
+      batch_file *f = &b->files[r->file];
+      if (res > 0 && r->got + res < r->len) {
+        r->got += res;
+        if (batch_prep(&s, f, r, slot) == 0)
+          continue;
+        res = -errno; // Fails the file like a read error
+      }
+      inflight--;
+      f->inflight--;
+      free_slots.push_back(slot);
+      if (res < 0) {
+        if (!f->err)
+          f->err = -res;
+      } else if (res == 0) {
+        if (!f->err)
+          f->err = EIO; // The file shrank under us
+      } else {
+        f->done += r->len;
+      }
+      if (!f->finished && !f->inflight && (f->err || f->done == f->size)) {
+        left--;
+        if (batch_finish(b, r->file, batch_now() - start, fn, arg))
+          ret = 1;
+      }
+    } while (app_peek_cqe(&s, &cqe) == 0);
+  }
+
+  // Stopped early: what is in flight still reads into the files' buffers
+  // until it and its cancel have completed.
+  int cancels = inflight > 0 && app_cancel(&s, 0, true, BATCH_CANCEL) == 0;
+  while (inflight > 0 || cancels > 0) {
+    struct io_uring_cqe *cqe;
+    if (app_wait_cqe(&s, &cqe) < 0)
+      break;
+    if (cqe->user_data == BATCH_CANCEL)
+      cancels--;
+    else
+      inflight--;
+    app_cqe_seen(&s);
+  }
+  for (size_t i = 0; i < b->files.size(); i++) {
+    batch_file *f = &b->files[i];
+    if (f->fd >= 0)
+      close(f->fd);
+    f->fd = -1;
+    free(f->data);
+    f->data = NULL;
+  }
+  batch_count(b, batch_now() - start);
+  b->stats.ring = s.stats;
+  app_teardown_uring(&s);
+  return ret < 0 ? -1 : 0;
+}
+
+// Completion times of the last my_batch_run(), counted from its start.
+int my_batch_stats(my_batch *b, my_sched_stats *st) {
+  *st = b->stats;
+  return 0;
+}
+
+void my_batch_close(my_batch *b) { delete b; }
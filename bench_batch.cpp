@@ -0,0 +1,81 @@
+#include "my_io.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sys/stat.h>
+
+// Read one batch of files under each scheduling policy, from a cold page
+// cache, and compare the files' completion times. Every file is due
+// DEADLINE_BASE plus DEADLINE_RATE per byte after the start. Files of
+// BULK_SZ or more are read at idle priority, the rest at best-effort.
+
+#define DEADLINE_BASE 5e-3
+#define DEADLINE_RATE (1.0 / (128 * 1024 * 1024))
+#define BULK_SZ (1024 * 1024)
+
+struct check {
+    uint64_t hash;
+    int failed;
+};
+
+static int on_file(int file, const char *data, ssize_t len, void *arg) {
+    check *c = static_cast<check *>(arg);
+    if (len < 0)
+        c->failed++;
+    else
+        c->hash ^= my_hash64(data, len, file);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int depth = 0;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-q") == 0) {
+        depth = atoi(argv[2]);
+        first = 3;
+    }
+    if (argc <= first || depth < 0) {
+        std::cerr << "Usage: " << argv[0] << " [-q depth] <filename>...\n";
+        return 1;
+    }
+
+    uint64_t expect = 0;
+    for (int p = MY_SCHED_FIFO; p <= MY_SCHED_WRR; p++) {
+        for (int i = first; i < argc; i++)
+            my_drop_cache(argv[i]);
+        my_prefetch_wait();
+
+        my_batch *b = my_batch_open(p, depth);
+        for (int i = first; i < argc; i++) {
+            struct stat st;
+            double size = stat(argv[i], &st) == 0 ? st.st_size : 0;
+            int file = my_batch_add(b, argv[i], DEADLINE_BASE + size * DEADLINE_RATE);
+            my_batch_prio(b, file, size >= BULK_SZ ? MY_PRIO_IDLE : MY_PRIO_BE);
+        }
+        check c = {0, 0};
+        if (my_batch_run(b, on_file, &c) < 0) {
+            perror("my_batch_run");
+            my_batch_close(b);
+            return 1;
+        }
+        my_sched_stats st;
+        my_batch_stats(b, &st);
+        my_batch_close(b);
+
+        std::cout << my_sched_name(p) << ": " << st.files << " files, " << st.bytes
+                  << " bytes, completion mean " << st.mean_sec * 1e3 << " ms, p95 "
+                  << st.p95_sec * 1e3 << " ms, max " << st.max_sec * 1e3 << " ms, total "
+                  << st.total_sec * 1e3 << " ms, " << st.missed << " deadlines missed\n"
+                  << "  mean best-effort " << st.prio_mean_sec[MY_PRIO_BE] * 1e3 << " ms, idle "
+                  << st.prio_mean_sec[MY_PRIO_IDLE] * 1e3 << " ms\n"
+                  << "  ring: " << st.ring.submitted << " SQEs, " << st.ring.enters << " enters\n";
+        if (c.failed)
+            std::cout << "  " << c.failed << " files failed\n";
+        if (p == MY_SCHED_FIFO)
+            expect = c.hash;
+        else if (c.hash != expect)
+            std::cout << "  MISMATCH with fifo\n";
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include "my_io.h"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <omp.h>
+#include <string>
+
+// Compare my_getline, on the ring and the mmap engine, against getline(3) and
+// std::getline on the same files, and the two engines' zero-copy views.
+
+struct result {
+    size_t lines;
+    size_t bytes;
+    double seconds;
+};
+
+static result bench_my_getline(const char *filename, int flags) {
+    result r = {0, 0, 0};
+    double start = omp_get_wtime();
+    my_file *mf = my_fopen_ex(filename, "r", flags);
+    if (!mf)
+        return r;
+    const char *line;
+    ssize_t n;
+    while ((n = my_getline(&line, mf)) > 0) {
+        r.lines++;
+        r.bytes += n;
+    }
+    my_fclose(mf);
+    r.seconds = omp_get_wtime() - start;
+    return r;
+}
+
+// Whole-file pass with my_fview(); lines counted with my_count_byte().
+static result bench_my_fview(const char *filename, int flags) {
+    result r = {0, 0, 0};
+    double start = omp_get_wtime();
+    my_file *mf = my_fopen_ex(filename, "r", flags);
+    if (!mf)
+        return r;
+    const char *data;
+    ssize_t n;
+    while ((n = my_fview(&data, mf)) > 0) {
+        r.lines += my_count_byte(data, data + n, '\n');
+        r.bytes += n;
+    }
+    my_fclose(mf);
+    r.seconds = omp_get_wtime() - start;
+    return r;
+}
+
+static result bench_posix_getline(const char *filename) {
+    result r = {0, 0, 0};
+    double start = omp_get_wtime();
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+        return r;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    while ((n = getline(&line, &cap, fp)) > 0) {
+        r.lines++;
+        r.bytes += n;
+    }
+    free(line);
+    fclose(fp);
+    r.seconds = omp_get_wtime() - start;
+    return r;
+}
+
+static result bench_std_getline(const char *filename) {
+    result r = {0, 0, 0};
+    double start = omp_get_wtime();
+    std::ifstream in(filename);
+    std::string line;
+    while (std::getline(in, line)) {
+        r.lines++;
+        r.bytes += line.size() + (in.eof() ? 0 : 1);
+    }
+    r.seconds = omp_get_wtime() - start;
+    return r;
+}
+
+static void report(const char *name, const result &r) {
+    double mbps = r.seconds > 0 ? r.bytes / r.seconds / (1024 * 1024) : 0;
+    std::cout << "  " << name << ": " << r.lines << " lines, " << r.bytes << " bytes, " << r.seconds
+              << " seconds (" << mbps << " MB/s)\n";
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <filename>...\n";
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        result mine = bench_my_getline(argv[i], 0);
+        result mapped = bench_my_getline(argv[i], MY_FOPEN_MMAP);
+        result view = bench_my_fview(argv[i], 0);
+        result mapped_view = bench_my_fview(argv[i], MY_FOPEN_MMAP);
+        result posix = bench_posix_getline(argv[i]);
+        result stl = bench_std_getline(argv[i]);
+
+        std::cout << argv[i] << ":\n";
+        report("my_getline ring", mine);
+        report("my_getline mmap", mapped);
+        report("my_fview ring  ", view);
+        report("my_fview mmap  ", mapped_view);
+        report("getline(3)     ", posix);
+        report("std::getline   ", stl);
+        if (mine.lines != posix.lines || mine.bytes != posix.bytes ||
+            mapped.lines != posix.lines || mapped.bytes != posix.bytes)
+            std::cout << "  MISMATCH between my_getline and getline(3)\n";
+    }
+    return 0;
+}
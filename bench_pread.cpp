@@ -0,0 +1,138 @@
+#include "my_io.h"
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <fcntl.h>
+#include <omp.h>
+#include <unistd.h>
+#include <vector>
+
+// Read a file sequentially, with a stride and at random with my_pread() and
+// with pread(2), from a cold page cache, and show what the read-ahead made of
+// each pattern.
+
+#define SEQ_READ (16 * 1024)
+#define STRIDE_READ 4096
+#define STRIDE (64 * 1024)
+
+static const char *pattern_names[] = {"none", "sequential", "strided", "random"};
+
+struct result {
+    size_t bytes;
+    double seconds;
+};
+
+// The offsets of each pattern's reads, and their length.
+static std::vector<off_t> offsets(int pattern, off_t size, size_t *len) {
+    std::vector<off_t> offs;
+    if (pattern == MY_RA_SEQUENTIAL) {
+        *len = SEQ_READ;
+        for (off_t off = 0; off < size; off += SEQ_READ)
+            offs.push_back(off);
+    } else {
+        *len = STRIDE_READ;
+        for (off_t off = 0; off + STRIDE_READ <= size; off += STRIDE)
+            offs.push_back(off);
+        if (pattern == MY_RA_RANDOM) {
+            srand(1);
+            for (size_t i = offs.size(); i > 1; i--)
+                std::swap(offs[i - 1], offs[rand() % i]);
+        }
+    }
+    return offs;
+}
+
+static void drop(const char *filename) {
+    my_drop_cache(filename);
+    my_prefetch_wait();
+}
+
+static result bench_my_pread(const char *filename, const std::vector<off_t> &offs, size_t len,
+                             my_readahead_stats *st) {
+    result r = {0, 0};
+    std::vector<char> buf(len);
+    drop(filename);
+    double start = omp_get_wtime();
+    my_file *mf = my_fopen_ex(filename, "r", MY_FOPEN_PREAD);
+    if (!mf)
+        return r;
+    for (size_t i = 0; i < offs.size(); i++) {
+        ssize_t n = my_pread(mf, buf.data(), len, offs[i]);
+        if (n < 0) {
+            perror("my_pread");
+            break;
+        }
+        r.bytes += n;
+    }
+    r.seconds = omp_get_wtime() - start;
+    my_ra_stats(mf, st);
+    my_fclose(mf);
+    return r;
+}
+
+static result bench_pread(const char *filename, const std::vector<off_t> &offs, size_t len) {
+    result r = {0, 0};
+    std::vector<char> buf(len);
+    drop(filename);
+    double start = omp_get_wtime();
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return r;
+    for (size_t i = 0; i < offs.size(); i++) {
+        ssize_t n = pread(fd, buf.data(), len, offs[i]);
+        if (n < 0)
+            break;
+        r.bytes += n;
+    }
+    close(fd);
+    r.seconds = omp_get_wtime() - start;
+    return r;
+}
+
+static void report(const char *name, const result &r) {
+    double mbps = r.seconds > 0 ? r.bytes / r.seconds / (1024 * 1024) : 0;
+    std::cout << "    " << name << ": " << r.bytes << " bytes, " << r.seconds << " seconds (" << mbps
+              << " MB/s)\n";
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <filename>...\n";
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        int fd = open(argv[i], O_RDONLY);
+        if (fd < 0) {
+            perror(argv[i]);
+            continue;
+        }
+        off_t size = get_file_size(fd);
+        close(fd);
+
+        std::cout << argv[i] << ":\n";
+        for (int p = MY_RA_SEQUENTIAL; p <= MY_RA_RANDOM; p++) {
+            size_t len;
+            std::vector<off_t> offs = offsets(p, size, &len);
+            my_readahead_stats st = {};
+            result mine = bench_my_pread(argv[i], offs, len, &st);
+            result posix = bench_pread(argv[i], offs, len);
+
+            std::cout << "  " << pattern_names[p] << ", " << offs.size() << " reads of " << len
+                      << " bytes:\n";
+            report("my_pread", mine);
+            report("pread(2)", posix);
+            double rate = st.reads ? 100.0 * st.hits / st.reads : 0;
+            std::cout << "    read-ahead: " << pattern_names[st.pattern] << ", depth " << st.depth
+                      << ", chunk " << st.chunk << ", hit rate " << rate << "% (" << st.hits << "/"
+                      << st.reads << "), " << st.ra_reads << " reads of " << st.ra_bytes
+                      << " bytes, " << st.wasted_bytes << " wasted\n";
+            double per_io = st.ring.submitted ? (double)st.ring.enters / st.ring.submitted : 0;
+            std::cout << "    ring: " << st.ring.submitted << " SQEs, " << st.ring.enters
+                      << " enters (" << per_io << " per I/O)\n";
+            if (mine.bytes != posix.bytes)
+                std::cout << "    MISMATCH between my_pread and pread(2)\n";
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,1011 @@
+#include "my_io.h"
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <omp.h>
+#include <sched.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#define COPY_MIN_RANGE (16 * 1024 * 1024)
+#define COPY_PIPE_SZ (1024 * 1024)
+#define COPY_BUF_SZ (128 * 1024)
+#define COPY_BUF_NR 8
+
+static ssize_t sys_copy_file_range(int fd_in, off_t *off_in, int fd_out,
+                                   off_t *off_out, size_t len) {
+  return syscall(__NR_copy_file_range, fd_in, off_in, fd_out, off_out, len, 0);
+}
+
+// Errors that mean "this path is not available here", not "the copy failed".
+static bool copy_path_unsupported(int err) {
+  return err == EXDEV || err == EINVAL || err == ENOSYS ||
+         err == EOPNOTSUPP || err == ETXTBSY;
+}
+
+const char *my_copy_path_name(int path) {
+  switch (path) {
+  case MY_COPY_RANGE:
+    return "copy_file_range";
+  case MY_COPY_SPLICE:
+    return "splice";
+  case MY_COPY_BUFFERED:
+    return "buffered";
+  default:
+    return "auto";
+  }
+}
+
+static int copy_range_cfr(int in_fd, int out_fd, off_t off, off_t len,
+                          size_t *done) {
+  off_t off_in = off, off_out = off;
+  while (len > 0) {
+    ssize_t n = sys_copy_file_range(in_fd, &off_in, out_fd, &off_out, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    if (n == 0)
+      break; // Source shrank underneath us.
+    *done += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * file -> pipe -> file, both halves as linked IORING_OP_SPLICE requests.
+ * The data never leaves the kernel.
+ */
+static int copy_range_splice(int in_fd, int out_fd, off_t off, off_t len,
+                             size_t *done) {
+  struct submitter s;
+  struct io_uring_cqe *cqe;
+  int pfd[2];
+  int ret = 0;
+
+  if (app_setup_uring_ex(&s, 4, 0))
+    return -ENOMEM;
+  if (pipe2(pfd, O_CLOEXEC) < 0) {
+    ret = -errno;
+    app_teardown_uring(&s);
+    return ret;
+  }
+  int pipe_sz = fcntl(pfd[1], F_SETPIPE_SZ, COPY_PIPE_SZ);
+  if (pipe_sz <= 0)
+    pipe_sz = 64 * 1024;
+
+  while (len > 0 && ret == 0) {
+    unsigned chunk = len > pipe_sz ? pipe_sz : (unsigned)len;
+
+    struct io_uring_sqe *sqe = app_get_sqe(&s);
+    if (!sqe) {
+      ret = -errno;
+      break;
+    }
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = in_fd;
+    sqe->splice_off_in = off;
+    sqe->fd = pfd[1];
+    sqe->off = (unsigned long long)-1;
+    sqe->len = chunk;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = 0;
+
+    if (!(sqe = app_get_sqe(&s))) {
+      ret = -errno;
+      break;
+    }
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = pfd[0];
+    sqe->splice_off_in = (unsigned long long)-1;
+    sqe->fd = out_fd;
+    sqe->off = off;
+    sqe->len = chunk;
+    sqe->user_data = 1;
+
+    if ((ret = app_submit(&s)) < 0)
+      break;
+    ret = 0;
+
+    int filled = 0, drained = 0;
+    for (int i = 0; i < 2; i++) {
+      if ((ret = app_wait_cqe(&s, &cqe)) < 0)
+        break;
+      if (cqe->user_data == 0)
+        filled = cqe->res;
+      else
+        drained = cqe->res;
+      app_cqe_seen(&s);
+    }
+    if (ret < 0)
+      break;
+    if (filled < 0) {
+      ret = filled;
+      break;
+    }
+    if (filled == 0)
+      break;
+    // A short fill cancels the linked drain; push out whatever is left.
+    if (drained < 0 && drained != -ECANCELED) {
+      ret = drained;
+      break;
+    }
+    if (drained < 0)
+      drained = 0;
+    while (drained < filled) {
+      loff_t out_off = off + drained;
+      ssize_t n = splice(pfd[0], NULL, out_fd, &out_off, filled - drained,
+                         SPLICE_F_MOVE);
+      if (n <= 0) {
+        ret = n < 0 ? -errno : -EIO;
+        break;
+      }
+      drained += n;
+    }
+    *done += filled;
+    off += filled;
+    len -= filled;
+  }
+
+  close(pfd[0]);
+  close(pfd[1]);
+  app_teardown_uring(&s);
+  return ret;
+}
+
+// Queue one read or write of copy_range_buffered(); -errno if no SQE is free.
+static int copy_prep_rw(struct submitter *s, int opcode, int fd, char *buf,
+                        unsigned len, unsigned long long off,
+                        unsigned long long user_data) {
+  struct io_uring_sqe *sqe = app_get_sqe(s);
+  if (!sqe)
+    return -errno;
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)buf;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->user_data = user_data;
+  return 0;
+}
+
+/*
+ * The io_uring_cp.c path: read into user buffers, write them back out. Keeps
+ * COPY_BUF_NR reads/writes in flight so the two directions overlap. With
+ * stream set out_fd cannot seek: reads still overlap, but the buffers are
+ * written one at a time, in file order, at the current position.
+ */
+static int copy_range_buffered(int in_fd, int out_fd, off_t off, off_t len,
+                               size_t *done, size_t *user, bool stream) {
+  struct slot {
+    char *buf;
+    off_t off;
+    unsigned len;
+    unsigned filled;
+    unsigned written;
+    bool ready; // stream: read in, waiting for its turn to be written
+  } slots[COPY_BUF_NR];
+  struct submitter s;
+  struct io_uring_cqe *cqe;
+  off_t next = off, end = off + len;
+  off_t wpos = off; // stream: where the next write has to start
+  bool writing = false;
+  int inflight = 0, ret = 0;
+
+  if (app_setup_uring_ex(&s, COPY_BUF_NR * 2, 0))
+    return -ENOMEM;
+  for (int i = 0; i < COPY_BUF_NR; i++) {
+    if (posix_memalign((void **)&slots[i].buf, BLOCK_SZ, COPY_BUF_SZ)) {
+      while (i--)
+        free(slots[i].buf);
+      app_teardown_uring(&s);
+      return -ENOMEM;
+    }
+  }
+
+  // user_data: slot index, bit 32 set for writes.
+  for (int i = 0; i < COPY_BUF_NR && next < end; i++) {
+    slots[i].off = next;
+    slots[i].len = end - next > COPY_BUF_SZ ? COPY_BUF_SZ : end - next;
+    slots[i].filled = 0;
+    slots[i].ready = false;
+    if ((ret = copy_prep_rw(&s, IORING_OP_READ, in_fd, slots[i].buf,
+                            slots[i].len, slots[i].off, i)) < 0)
+      break;
+    next += slots[i].len;
+    inflight++;
+  }
+
+  for (;;) {
+    // stream: the buffer that starts at wpos goes out once the last write
+    // is in.
+    for (int i = 0; stream && !writing && ret == 0 && i < COPY_BUF_NR; i++) {
+      struct slot *sl = &slots[i];
+      if (!sl->ready || sl->off != wpos)
+        continue;
+      if ((ret = copy_prep_rw(&s, IORING_OP_WRITE, out_fd, sl->buf, sl->len,
+                              (unsigned long long)-1, (1ULL << 32) | i)) < 0)
+        break;
+      sl->ready = false;
+      writing = true;
+      inflight++;
+    }
+    if (inflight == 0)
+      break;
+    if (app_submit(&s) < 0 || app_wait_cqe(&s, &cqe) < 0) {
+      ret = -EIO;
+      break;
+    }
+    int i = (int)(cqe->user_data & 0xffffffff);
+    bool is_write = cqe->user_data >> 32;
+    int res = cqe->res;
+    app_cqe_seen(&s);
+    inflight--;
+    struct slot *sl = &slots[i];
+
+    if (res < 0) {
+      ret = res;
+      continue; // Drain what is still in flight before bailing out.
+    }
+    if (ret < 0)
+      continue;
+
+    if (!is_write) {
+      *user += res;
+      sl->filled += res;
+      if (res == 0)
+        sl->len = sl->filled; // EOF before the expected length.
+      if (sl->len == 0)
+        continue;
+      if (sl->filled < sl->len) {
+        if ((ret = copy_prep_rw(&s, IORING_OP_READ, in_fd,
+                                sl->buf + sl->filled, sl->len - sl->filled,
+                                sl->off + sl->filled, i)) == 0)
+          inflight++;
+        continue;
+      }
+      sl->written = 0;
+      if (stream) {
+        sl->ready = true;
+        continue;
+      }
+    } else {
+      if (res == 0) {
+        ret = -EIO; // A write that makes no progress never will.
+        continue;
+      }
+      sl->written += res;
+      if (sl->written == sl->len) {
+        *done += sl->len;
+        if (stream) {
+          wpos += sl->len;
+          writing = false;
+        }
+        if (next >= end)
+          continue;
+        sl->off = next;
+        sl->len = end - next > COPY_BUF_SZ ? COPY_BUF_SZ : end - next;
+        sl->filled = 0;
+        if ((ret = copy_prep_rw(&s, IORING_OP_READ, in_fd, sl->buf, sl->len,
+                                sl->off, i)) < 0)
+          continue;
+        next += sl->len;
+        inflight++;
+        continue;
+      }
+    }
+    if ((ret = copy_prep_rw(
+             &s, IORING_OP_WRITE, out_fd, sl->buf + sl->written,
+             sl->len - sl->written,
+             stream ? (unsigned long long)-1 : sl->off + sl->written,
+             (1ULL << 32) | i)) == 0)
+      inflight++;
+  }
+
+  for (int i = 0; i < COPY_BUF_NR; i++)
+    free(slots[i].buf);
+  app_teardown_uring(&s);
+  return ret;
+}
+
+/*
+ * Copy one range, starting at the requested path and falling back
+ * range -> splice -> buffered while the kernel reports the path as
+ * unsupported for this pair of files. Returns the path that finished the job.
+ */
+static int copy_range(int in_fd, int out_fd, off_t off, off_t len, int path,
+                      size_t *done, size_t *user, int *err) {
+  for (;;) {
+    size_t before = *done;
+    int ret;
+    if (path == MY_COPY_RANGE)
+      ret = copy_range_cfr(in_fd, out_fd, off, len, done);
+    else if (path == MY_COPY_SPLICE)
+      ret = copy_range_splice(in_fd, out_fd, off, len, done);
+    else
+      ret = copy_range_buffered(in_fd, out_fd, off, len, done, user, false);
+
+    if (ret == 0 || path == MY_COPY_BUFFERED || !copy_path_unsupported(-ret)) {
+      *err = ret;
+      return path;
+    }
+    // Resume where the failed path stopped.
+    off += *done - before;
+    len -= *done - before;
+    path++;
+  }
+}
+
+/*
+ * A source with no size (pipe, FIFO, terminal, socket, most of /proc) is
+ * read through a pipeline until EOF and written out in order at out_fd's
+ * current position.
+ */
+static int copy_stream(int in_fd, int out_fd, size_t *done, size_t *user) {
+  int pfd = dup(in_fd);
+  my_pipeline *pl = pfd < 0 ? NULL : my_pipe_fdopen(pfd);
+  if (!pl || my_pipe_start(pl) < 0) {
+    int err = errno ? -errno : -EIO;
+    if (pl)
+      my_pipe_close(pl);
+    else if (pfd >= 0)
+      close(pfd);
+    return err;
+  }
+
+  const char *data;
+  ssize_t n = 0;
+  int ret = 0;
+  while (ret == 0 && (n = my_pipe_view(pl, &data)) > 0) {
+    *user += n;
+    while (n > 0) {
+      ssize_t w = write(out_fd, data, n);
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w <= 0) {
+        ret = w < 0 ? -errno : -EIO;
+        break;
+      }
+      data += w;
+      n -= w;
+      *done += w;
+    }
+  }
+  if (ret == 0 && n < 0)
+    ret = -errno;
+  my_pipe_close(pl);
+  return ret;
+}
+
+int my_copy_fd(int in_fd, int out_fd, off_t len, int path, int threads,
+               struct my_copy_stats *st) {
+  struct stat in_st, out_st;
+  double start = omp_get_wtime();
+
+  memset(st, 0, sizeof(*st));
+  if (fstat(in_fd, &in_st) < 0 || fstat(out_fd, &out_st) < 0) {
+    perror("fstat");
+    return -1;
+  }
+
+  // Without a size the source is read until EOF, and len does not apply.
+  // A pipe or terminal takes the bytes in the order they are written, so it
+  // gets one in-order stream of buffered writes whatever the path asked for.
+  bool unsized = S_ISREG(in_st.st_mode) ? in_st.st_size == 0
+                                         : !S_ISBLK(in_st.st_mode);
+  if (unsized || (!S_ISREG(out_st.st_mode) && !S_ISBLK(out_st.st_mode))) {
+    size_t done = 0, user = 0;
+    int err = unsized ? copy_stream(in_fd, out_fd, &done, &user)
+                      : copy_range_buffered(in_fd, out_fd, 0, len, &done,
+                                            &user, true);
+    st->path = MY_COPY_BUFFERED;
+    st->bytes_copied = done;
+    st->bytes_user = user;
+    st->seconds = omp_get_wtime() - start;
+    if (err < 0) {
+      errno = -err;
+      perror("my_copy");
+      return -1;
+    }
+    return 0;
+  }
+
+  if (path == MY_COPY_AUTO) {
+    if (!S_ISREG(in_st.st_mode) || !S_ISREG(out_st.st_mode))
+      path = MY_COPY_BUFFERED;
+    else if (in_st.st_dev == out_st.st_dev)
+      path = MY_COPY_RANGE; // Same filesystem: reflink or in-kernel copy.
+    else
+      path = MY_COPY_SPLICE;
+  }
+  if (threads < 1)
+    threads = omp_get_max_threads();
+
+  // Ranges are big enough that per-range setup is noise.
+  int ranges = (int)((len + COPY_MIN_RANGE - 1) / COPY_MIN_RANGE);
+  if (ranges > threads)
+    ranges = threads;
+  if (ranges < 1)
+    ranges = 1;
+  off_t range_sz = (len + ranges - 1) / ranges;
+  range_sz = (range_sz + BLOCK_SZ - 1) & ~((off_t)BLOCK_SZ - 1);
+
+  size_t done = 0, user = 0;
+  int used = path, failed = 0;
+
+#pragma omp parallel for num_threads(ranges) reduction(+ : done, user)        \
+    reduction(max : used) reduction(min : failed)
+  for (int r = 0; r < ranges; r++) {
+    off_t off = (off_t)r * range_sz;
+    off_t n = off + range_sz > len ? len - off : range_sz;
+    int err = 0;
+    if (n <= 0)
+      continue;
+    int p = copy_range(in_fd, out_fd, off, n, path, &done, &user, &err);
+    if (p > used)
+      used = p;
+    if (err < failed)
+      failed = err;
+  }
+
+  st->path = used;
+  st->bytes_copied = done;
+  st->bytes_user = user;
+  st->seconds = omp_get_wtime() - start;
+  if (failed < 0) {
+    errno = -failed;
+    perror("my_copy");
+    return -1;
+  }
+  // Parallel ranges may leave the tail unwritten if the source shrank.
+  if (S_ISREG(out_st.st_mode) && ftruncate(out_fd, done) < 0) {
+    perror("ftruncate");
+    return -1;
+  }
+  return 0;
+}
+
+int my_copy_file(const char *src, const char *dst, int path, int threads,
+                 struct my_copy_stats *st) {
+  int in_fd = open(src, O_RDONLY);
+  if (in_fd < 0) {
+    perror(src);
+    return -1;
+  }
+  struct stat in_st;
+  if (fstat(in_fd, &in_st) < 0) {
+    perror("fstat");
+    close(in_fd);
+    return -1;
+  }
+  // O_TRUNC would empty the source before a byte of it is read.
+  struct stat out_st;
+  if (stat(dst, &out_st) == 0 && out_st.st_dev == in_st.st_dev &&
+      out_st.st_ino == in_st.st_ino) {
+    fprintf(stderr, "%s and %s are the same file\n", src, dst);
+    close(in_fd);
+    errno = EINVAL;
+    return -1;
+  }
+  int out_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, in_st.st_mode & 0777);
+  if (out_fd < 0) {
+    perror(dst);
+    close(in_fd);
+    return -1;
+  }
+
+  off_t len = get_file_size(in_fd); // Block devices too
+  int ret = len < 0 ? -1 : my_copy_fd(in_fd, out_fd, len, path, threads, st);
+  close(in_fd);
+  if (close(out_fd) < 0 && ret == 0) {
+    perror("close");
+    ret = -1;
+  }
+  return ret;
+}
+
+/*
+ * Recursive copy. The tree is walked once with getdents64 to build the file
+ * list and the destination directories; the files are then streamed through
+ * one ring per worker thread while a shared counter caps the number of
+ * requests in flight across all rings.
+ */
+#define TREE_JOBS 32   // Files open at once per worker
+#define TREE_SLOTS 16  // Copy buffers per worker
+#define TREE_DENTS_SZ (64 * 1024)
+
+enum { TREE_OP_OPEN_SRC = 1, TREE_OP_OPEN_DST, TREE_OP_READ, TREE_OP_WRITE };
+
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+struct tree_entry {
+  std::string src;
+  std::string dst;
+  off_t size;
+  mode_t mode;
+  struct timespec times[2];
+  bool same_dev;
+};
+
+struct tree_job {
+  const tree_entry *e;
+  int in_fd;
+  int out_fd;
+  int opens; // OPENAT completions still outstanding
+  int inflight;
+  int err;
+  off_t next;
+  off_t done;
+};
+
+struct tree_slot {
+  char *buf;
+  int job;
+  off_t off;
+  unsigned len;
+  unsigned filled;
+  unsigned written;
+};
+
+// Whether dst is src or lies inside it: each ancestor of dst that exists,
+// up to the root, is compared with src.
+static bool tree_inside(const struct stat *src_st, const char *dst) {
+  std::string p = dst;
+  struct stat st, up;
+  while (stat(p.c_str(), &st) < 0) { // Not created yet: try its parent
+    size_t slash = p.find_last_of('/');
+    p = slash == std::string::npos ? "." : slash ? p.substr(0, slash) : "/";
+  }
+  for (;;) {
+    if (st.st_dev == src_st->st_dev && st.st_ino == src_st->st_ino)
+      return true;
+    p += "/..";
+    if (stat(p.c_str(), &up) < 0 ||
+        (up.st_dev == st.st_dev && up.st_ino == st.st_ino))
+      return false; // Reached the root
+    st = up;
+  }
+}
+
+static int tree_walk(const char *src, const char *dst,
+                     std::vector<tree_entry> &files,
+                     std::vector<tree_entry> &dirs, size_t *failed) {
+  struct stat st, dst_st;
+  std::vector<size_t> pending;
+  char *dents = (char *)malloc(TREE_DENTS_SZ);
+
+  if (!dents || stat(src, &st) < 0) {
+    perror(src);
+    free(dents);
+    return -1;
+  }
+  // O_TRUNC would empty the source, or the walk would follow the copy down.
+  if (tree_inside(&st, dst)) {
+    fprintf(stderr, "cannot copy %s into itself, %s\n", src, dst);
+    free(dents);
+    errno = EINVAL;
+    return -1;
+  }
+  if (mkdir(dst, 0700) < 0 && errno != EEXIST) {
+    perror(dst);
+    free(dents);
+    return -1;
+  }
+  if (stat(dst, &dst_st) < 0) {
+    perror(dst);
+    free(dents);
+    return -1;
+  }
+
+  tree_entry root = {src, dst, 0, st.st_mode, {st.st_atim, st.st_mtim}, false};
+  dirs.push_back(root);
+  pending.push_back(0);
+
+  while (!pending.empty()) {
+    size_t d = pending.back();
+    pending.pop_back();
+    std::string dir_src = dirs[d].src, dir_dst = dirs[d].dst;
+
+    int dfd = open(dir_src.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) {
+      perror(dir_src.c_str());
+      (*failed)++;
+      continue;
+    }
+
+    long nread;
+    while ((nread = syscall(__NR_getdents64, dfd, dents, TREE_DENTS_SZ)) > 0) {
+      for (long pos = 0; pos < nread;) {
+        struct linux_dirent64 *de = (struct linux_dirent64 *)(dents + pos);
+        pos += de->d_reclen;
+        const char *name = de->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+          continue;
+        if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+          perror(name);
+          (*failed)++;
+          continue;
+        }
+
+        tree_entry e = {dir_src + "/" + name, dir_dst + "/" + name, st.st_size,
+                        st.st_mode, {st.st_atim, st.st_mtim},
+                        st.st_dev == dst_st.st_dev};
+        if (S_ISDIR(st.st_mode)) {
+          // Owner write access until the files are in; the real mode is
+          // applied once the copy is done.
+          if (mkdir(e.dst.c_str(), 0700) < 0 && errno != EEXIST) {
+            perror(e.dst.c_str());
+            (*failed)++;
+            continue;
+          }
+          dirs.push_back(e);
+          pending.push_back(dirs.size() - 1);
+        } else if (S_ISREG(st.st_mode)) {
+          files.push_back(e);
+        } else if (S_ISLNK(st.st_mode)) {
+          char target[PATH_MAX];
+          ssize_t n = readlinkat(dfd, name, target, sizeof(target) - 1);
+          if (n < 0) {
+            perror(e.src.c_str());
+            (*failed)++;
+            continue;
+          }
+          target[n] = '\0';
+          unlink(e.dst.c_str());
+          if (symlink(target, e.dst.c_str()) < 0) {
+            perror(e.dst.c_str());
+            (*failed)++;
+            continue;
+          }
+          utimensat(AT_FDCWD, e.dst.c_str(), e.times, AT_SYMLINK_NOFOLLOW);
+        } else {
+          fprintf(stderr, "%s: skipping special file\n", e.src.c_str());
+        }
+      }
+    }
+    if (nread < 0) {
+      perror(dir_src.c_str());
+      (*failed)++;
+    }
+    close(dfd);
+  }
+
+  free(dents);
+  return 0;
+}
+
+// Queue a read or write of a tree slot; -1 if no SQE is free.
+static int tree_prep_rw(struct submitter *s, int op, int fd, char *buf,
+                        unsigned len, off_t off, int slot) {
+  struct io_uring_sqe *sqe = app_get_sqe(s);
+  if (!sqe)
+    return -1;
+  sqe->opcode = op == TREE_OP_READ ? IORING_OP_READ : IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)buf;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->user_data = ((unsigned long long)op << 32) | slot;
+  return 0;
+}
+
+// Take n units of the global in-flight budget, or report that they are spent.
+static bool tree_acquire(std::atomic<int> *inflight, int limit, int n) {
+  if (inflight->fetch_add(n, std::memory_order_relaxed) + n <= limit)
+    return true;
+  inflight->fetch_sub(n, std::memory_order_relaxed);
+  return false;
+}
+
+static void tree_finish(struct tree_job *job, size_t *files, size_t *bytes,
+                        size_t *failed) {
+  const tree_entry *e = job->e;
+  if (job->out_fd >= 0 && job->err == 0) {
+    if (fchmod(job->out_fd, e->mode & 07777) < 0 ||
+        futimens(job->out_fd, e->times) < 0)
+      job->err = -errno;
+  }
+  if (job->in_fd >= 0)
+    close(job->in_fd);
+  if (job->out_fd >= 0 && close(job->out_fd) < 0 && job->err == 0)
+    job->err = -errno;
+  if (job->err) {
+    errno = -job->err;
+    perror(e->dst.c_str());
+    (*failed)++;
+  } else {
+    (*files)++;
+    *bytes += job->done;
+  }
+  job->e = NULL;
+}
+
+static void tree_worker(const std::vector<tree_entry> &files,
+                        std::atomic<size_t> *next_file,
+                        std::atomic<int> *inflight, int limit,
+                        struct my_copy_stats *st, size_t *failed) {
+  struct submitter s;
+  struct tree_job jobs[TREE_JOBS];
+  struct tree_slot slots[TREE_SLOTS];
+  int free_slots[TREE_SLOTS], nfree = 0;
+  int active = 0, local = 0;
+  bool drained = false;
+
+  if (app_setup_uring_ex(&s, TREE_JOBS * 2 + TREE_SLOTS, 0)) {
+    (*failed)++;
+    return;
+  }
+  memset(jobs, 0, sizeof(jobs));
+  for (int i = 0; i < TREE_SLOTS; i++) {
+    if (posix_memalign((void **)&slots[i].buf, BLOCK_SZ, COPY_BUF_SZ) == 0)
+      free_slots[nfree++] = i;
+  }
+  bool have_bufs = nfree > 0; // Without any, no file with data can be read
+
+  for (;;) {
+    // Claim more files while job slots are free; their opens go out in the
+    // same submission as everything else queued below.
+    for (int j = 0; j < TREE_JOBS && !drained; j++) {
+      if (jobs[j].e)
+        continue;
+      // Both OPENATs are paid for before the file is claimed.
+      if (!tree_acquire(inflight, limit, 2))
+        break;
+      size_t idx = next_file->fetch_add(1, std::memory_order_relaxed);
+      if (idx >= files.size()) {
+        inflight->fetch_sub(2, std::memory_order_relaxed);
+        drained = true;
+        break;
+      }
+      const tree_entry *e = &files[idx];
+      if (e->same_dev && e->size >= COPY_MIN_RANGE) {
+        inflight->fetch_sub(2, std::memory_order_relaxed);
+        // Large file on the same filesystem: let the kernel copy it.
+        struct tree_job big = {e, open(e->src.c_str(), O_RDONLY | O_CLOEXEC),
+                               -1, 0, 0, 0, 0, 0};
+        if (big.in_fd >= 0)
+          big.out_fd = open(e->dst.c_str(),
+                            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (big.in_fd < 0 || big.out_fd < 0) {
+          big.err = -errno;
+        } else {
+          size_t done = 0, user = 0;
+          int p = copy_range(big.in_fd, big.out_fd, 0, e->size, MY_COPY_RANGE,
+                             &done, &user, &big.err);
+          big.done = done;
+          st->bytes_user += user;
+          if (p > st->path)
+            st->path = p;
+        }
+        tree_finish(&big, &st->files, &st->bytes_copied, failed);
+        j--;
+        continue;
+      }
+      struct tree_job *job = &jobs[j];
+      memset(job, 0, sizeof(*job));
+      job->e = e;
+      job->in_fd = job->out_fd = -1;
+      job->opens = 2;
+      active++;
+      st->path = MY_COPY_BUFFERED;
+      struct io_uring_sqe *sqe =
+          have_bufs || e->size == 0 ? app_get_sqe(&s) : NULL;
+      if (!sqe) {
+        // The job fails without I/O and is finished below.
+        job->err = have_bufs || e->size == 0 ? -errno : -ENOMEM;
+        job->opens = 0;
+        inflight->fetch_sub(2, std::memory_order_relaxed);
+        continue;
+      }
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (unsigned long)e->src.c_str();
+      sqe->open_flags = O_RDONLY | O_CLOEXEC;
+      sqe->user_data = ((unsigned long long)TREE_OP_OPEN_SRC << 32) | j;
+      local++;
+      if (!(sqe = app_get_sqe(&s))) {
+        // Fails once the source open, already queued, is back.
+        job->err = -errno;
+        job->opens = 1;
+        inflight->fetch_sub(1, std::memory_order_relaxed);
+        continue;
+      }
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (unsigned long)e->dst.c_str();
+      sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+      sqe->len = 0600;
+      sqe->user_data = ((unsigned long long)TREE_OP_OPEN_DST << 32) | j;
+      local++;
+    }
+
+    // Hand free buffers to open files, round-robin, within the global budget.
+    bool progress = true;
+    while (nfree > 0 && progress) {
+      progress = false;
+      for (int j = 0; j < TREE_JOBS && nfree > 0; j++) {
+        struct tree_job *job = &jobs[j];
+        if (!job->e || job->opens || job->err || job->next >= job->e->size)
+          continue;
+        if (!tree_acquire(inflight, limit, 1))
+          break;
+        int i = free_slots[--nfree];
+        struct tree_slot *sl = &slots[i];
+        sl->job = j;
+        sl->off = job->next;
+        sl->len = job->e->size - job->next > COPY_BUF_SZ
+                      ? COPY_BUF_SZ
+                      : job->e->size - job->next;
+        sl->filled = sl->written = 0;
+        if (tree_prep_rw(&s, TREE_OP_READ, job->in_fd, sl->buf, sl->len,
+                         sl->off, i) < 0) {
+          job->err = -errno;
+          free_slots[nfree++] = i;
+          inflight->fetch_sub(1, std::memory_order_relaxed);
+          continue;
+        }
+        job->next += sl->len;
+        job->inflight++;
+        local++;
+        progress = true;
+      }
+    }
+
+    // Files that need no I/O (empty, failed opens) finish here.
+    for (int j = 0; j < TREE_JOBS; j++) {
+      struct tree_job *job = &jobs[j];
+      if (job->e && !job->opens && !job->inflight &&
+          (job->err || job->next >= job->e->size)) {
+        tree_finish(job, &st->files, &st->bytes_copied, failed);
+        active--;
+      }
+    }
+
+    if (local == 0) {
+      if (drained && active == 0)
+        break;
+      sched_yield(); // The budget is held by other workers.
+      continue;
+    }
+
+    struct io_uring_cqe *cqe;
+    if (app_submit(&s) < 0 || app_wait_cqe(&s, &cqe) < 0)
+      break;
+    do {
+      int op = (int)(cqe->user_data >> 32);
+      int idx = (int)(cqe->user_data & 0xffffffff);
+      int res = cqe->res;
+      app_cqe_seen(&s);
+      local--;
+      inflight->fetch_sub(1, std::memory_order_relaxed);
+
+      if (op == TREE_OP_OPEN_SRC || op == TREE_OP_OPEN_DST) {
+        struct tree_job *job = &jobs[idx];
+        job->opens--;
+        if (res < 0)
+          job->err = res;
+        else if (op == TREE_OP_OPEN_SRC)
+          job->in_fd = res;
+        else
+          job->out_fd = res;
+        continue;
+      }
+
+      struct tree_slot *sl = &slots[idx];
+      struct tree_job *job = &jobs[sl->job];
+      bool more = false;
+      if (res < 0) {
+        job->err = res;
+      } else if (op == TREE_OP_READ) {
+        st->bytes_user += res;
+        sl->filled += res;
+        if (res == 0)
+          sl->len = sl->filled;
+        if (sl->filled < sl->len)
+          more = tree_prep_rw(&s, TREE_OP_READ, job->in_fd,
+                              sl->buf + sl->filled, sl->len - sl->filled,
+                              sl->off + sl->filled, idx) == 0;
+        else if (sl->len)
+          more = tree_prep_rw(&s, TREE_OP_WRITE, job->out_fd, sl->buf,
+                              sl->len, sl->off, idx) == 0;
+        if (!more && sl->len)
+          job->err = -errno;
+      } else if (res == 0) {
+        job->err = -EIO; // A write that makes no progress never will.
+      } else {
+        sl->written += res;
+        if (sl->written == sl->len)
+          job->done += sl->len;
+        else if (!(more = tree_prep_rw(&s, TREE_OP_WRITE, job->out_fd,
+                                       sl->buf + sl->written,
+                                       sl->len - sl->written,
+                                       sl->off + sl->written, idx) == 0))
+          job->err = -errno;
+      }
+      if (more) {
+        // The follow-up request inherits this one's budget.
+        inflight->fetch_add(1, std::memory_order_relaxed);
+        local++;
+      } else {
+        job->inflight--;
+        free_slots[nfree++] = idx;
+      }
+    } while (app_peek_cqe(&s, &cqe) == 0);
+  }
+
+  for (int j = 0; j < TREE_JOBS; j++) {
+    if (jobs[j].e) {
+      jobs[j].err = jobs[j].err ? jobs[j].err : -EIO;
+      tree_finish(&jobs[j], &st->files, &st->bytes_copied, failed);
+    }
+  }
+  for (int i = 0; i < TREE_SLOTS; i++)
+    if (slots[i].buf)
+      free(slots[i].buf);
+  app_teardown_uring(&s);
+}
+
+int my_copy_tree(const char *src, const char *dst, int threads,
+                 int max_inflight, struct my_copy_stats *st) {
+  std::vector<tree_entry> files, dirs;
+  std::atomic<size_t> next_file(0);
+  std::atomic<int> inflight(0);
+  size_t failed = 0;
+  double start = omp_get_wtime();
+
+  memset(st, 0, sizeof(*st));
+  if (tree_walk(src, dst, files, dirs, &failed) < 0)
+    return -1;
+  if (threads < 1)
+    threads = omp_get_max_threads();
+  if (max_inflight < 1)
+    max_inflight = QUEUE_DEPTH;
+  else if (max_inflight < 2)
+    max_inflight = 2; // A file's two opens are claimed together
+
+#pragma omp parallel num_threads(threads)
+  {
+    struct my_copy_stats local;
+    size_t local_failed = 0;
+    memset(&local, 0, sizeof(local));
+    tree_worker(files, &next_file, &inflight, max_inflight, &local,
+                &local_failed);
+#pragma omp critical
+    {
+      st->files += local.files;
+      st->bytes_copied += local.bytes_copied;
+      st->bytes_user += local.bytes_user;
+      if (local.path > st->path)
+        st->path = local.path;
+      failed += local_failed;
+    }
+  }
+
+  // Deepest directories first, so setting a parent's mtime is the last write
+  // into it.
+  for (size_t d = dirs.size(); d-- > 0;) {
+    if (chmod(dirs[d].dst.c_str(), dirs[d].mode & 07777) < 0 ||
+        utimensat(AT_FDCWD, dirs[d].dst.c_str(), dirs[d].times, 0) < 0) {
+      perror(dirs[d].dst.c_str());
+      failed++;
+    }
+  }
+  st->dirs = dirs.size();
+  st->seconds = omp_get_wtime() - start;
+  return failed ? -1 : 0;
+}
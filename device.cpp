@@ -1,5 +1,8 @@
 #define QUEUE_DEPTH 256
 #define BLOCK_SZ 4096
+#define MY_TIMEOUT_DATA (~0ull) // As in my_io.h
+#define DEV_ETIMEDOUT 110       // errno values, as in <errno.h>
+#define DEV_ECANCELED 125
 
 /*
  * Filled with the offset for mmap(2)
@@ -122,6 +125,14 @@ struct submitter {
   app_io_sq_ring sq_ring;
   struct io_uring_sqe_own *sqes;
   app_io_cq_ring cq_ring;
+  unsigned setup_flags;
+  unsigned sq_tail;
+  void *sq_ptr;
+  unsigned long sq_sz;
+  void *cq_ptr;
+  unsigned long cq_sz;
+  unsigned long sqes_sz;
+  unsigned long stats[3]; // my_ring_stats
 };
 
 struct iovc {
@@ -143,6 +154,14 @@ struct my_file {
   submitter *s;
   file_info *fi_read;
   file_info *fi;
+  char *line_buf;
+  unsigned long line_cap;
+  void *map;
+  unsigned long map_sz;
+  struct my_readahead *ra;
+  unsigned short ioprio;
+  long (*pread)(struct my_file *mf, void *buf, unsigned long len, long off);
+  int err;
 };
 
 int systemTimes = 0;
@@ -164,6 +183,18 @@ unsigned long my_fread(void *ptr, unsigned long size, unsigned long count,
   unsigned index = mf->current_block;
   unsigned long offset = mf->current_offset;
 
+  if (mf->err)
+    return 0; // The READV failed; my_ferror() says why
+
+  // MY_FOPEN_PREAD: no blocks, current_offset is the file position.
+  if (mf->pread) {
+    long n = mf->pread(mf, ptr, total_bytes, offset);
+    if (n <= 0)
+      return 0;
+    mf->current_offset = offset + n;
+    return n;
+  }
+
   if (index >= mf->blocks)
     return 0;
 
@@ -178,11 +209,18 @@ unsigned long my_fread(void *ptr, unsigned long size, unsigned long count,
     // save it to reduce time spent.
     if (mf->isfirst == 0) {
       cqe = &cring->cqes[head & *s->cq_ring.ring_mask];
+      if (cqe->user_data == MY_TIMEOUT_DATA) {
+        head++; // The READV's deadline, fired or not
+        continue;
+      }
       fi_read = (struct file_info *)cqe->user_data;
       mf->fi_read = fi_read;
       mf->isfirst = 1;
       if (cqe->res < 0) {
-        break;
+        // Only the deadline cancels a READV that is still being waited for.
+        mf->err = cqe->res == -DEV_ECANCELED ? DEV_ETIMEDOUT : -cqe->res;
+        __atomic_store_n(cring->head, head + 1, __ATOMIC_RELEASE);
+        return 0;
       }
     } else {
       fi_read = mf->fi_read;
@@ -0,0 +1,278 @@
+#include "my_io.h"
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+/*
+ * Inflate stage for compressed inputs. The caller's thread keeps GZ_DEPTH
+ * compressed chunks in flight on the file's ring while a worker thread
+ * inflates the chunks that have already arrived, in file order, into the
+ * BLOCK_SZ blocks my_fread() and my_getline() read from. A chunk buffer goes
+ * back to the reader only once it has been inflated, so a slow inflate holds
+ * back the read-ahead instead of queueing unbounded input.
+ */
+#define GZ_CHUNK (256 * 1024)
+#define GZ_DEPTH 4
+
+enum { GZ_FREE, GZ_INFLIGHT, GZ_READY };
+
+struct gz_slot {
+  char *buf;
+  unsigned len;
+  unsigned filled;
+  int state;
+};
+
+struct gz_pipe {
+  struct gz_slot slots[GZ_DEPTH];
+  long long nchunks;
+  std::mutex lock;
+  std::condition_variable cv;
+  bool failed;
+  int err; // errno for the caller once failed is set
+  z_stream zs;
+  std::vector<void *> blocks;
+  size_t last_fill; // Bytes used in blocks.back()
+  bool mid_member; // Input ended inside a member: the file is truncated
+  bool ended;      // A member has just ended
+  bool padding;    // Skipping NULs after the last member, as zcat does
+};
+
+// gzip member header magic; zlib streams are only taken when asked for.
+bool my_gz_detect(int fd) {
+  unsigned char magic[2];
+  return pread(fd, magic, 2, 0) == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+static int gz_out_block(gz_pipe *p) {
+  void *buf;
+  if (posix_memalign(&buf, BLOCK_SZ, BLOCK_SZ))
+    return -1;
+  p->blocks.push_back(buf);
+  p->last_fill = 0;
+  p->zs.next_out = static_cast<Bytef *>(buf);
+  p->zs.avail_out = BLOCK_SZ;
+  return 0;
+}
+
+// Inflate one chunk of input; -errno on failure.
+static int gz_inflate_chunk(gz_pipe *p, const char *data, size_t len) {
+  p->zs.next_in = (Bytef *)data;
+  p->zs.avail_in = len;
+  while (p->zs.avail_in > 0) {
+    if (p->padding || (p->ended && *p->zs.next_in == 0)) {
+      if (*p->zs.next_in != 0) {
+        fprintf(stderr, "inflate: trailing garbage after padding\n");
+        return -EINVAL;
+      }
+      p->padding = true;
+      p->zs.next_in++;
+      p->zs.avail_in--;
+      continue;
+    }
+    if (p->zs.avail_out == 0 && gz_out_block(p) < 0)
+      return -ENOMEM;
+    unsigned before = p->zs.avail_out;
+    int ret = inflate(&p->zs, Z_NO_FLUSH);
+    p->last_fill += before - p->zs.avail_out;
+    p->mid_member = ret != Z_STREAM_END;
+    p->ended = ret == Z_STREAM_END;
+    if (ret == Z_STREAM_END) {
+      // Concatenated members decompress to the concatenation, as with zcat.
+      if (inflateReset(&p->zs) != Z_OK)
+        return -EINVAL;
+    } else if (ret == Z_MEM_ERROR) {
+      return -ENOMEM;
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      fprintf(stderr, "inflate: %s\n", p->zs.msg ? p->zs.msg : "error");
+      return -EINVAL;
+    }
+  }
+  return 0;
+}
+
+static void gz_worker(gz_pipe *p) {
+  for (long long k = 0; k < p->nchunks; k++) {
+    struct gz_slot *sl = &p->slots[k % GZ_DEPTH];
+    {
+      std::unique_lock<std::mutex> guard(p->lock);
+      while (sl->state != GZ_READY && !p->failed)
+        p->cv.wait(guard);
+      if (p->failed)
+        return;
+    }
+    int err = gz_inflate_chunk(p, sl->buf, sl->filled);
+    std::lock_guard<std::mutex> guard(p->lock);
+    sl->state = GZ_FREE;
+    if (err && !p->failed) {
+      p->failed = true;
+      p->err = -err;
+    }
+    p->cv.notify_all();
+  }
+  std::lock_guard<std::mutex> guard(p->lock);
+  if (p->mid_member && !p->failed) {
+    fprintf(stderr, "inflate: unexpected end of file\n");
+    p->err = EIO;
+    p->failed = true;
+    p->cv.notify_all();
+  }
+}
+
+static int gz_prep_read(struct submitter *s, int fd, struct gz_slot *sl,
+                        off_t off, int i) {
+  struct io_uring_sqe *sqe = app_get_sqe(s);
+  if (!sqe)
+    return -errno;
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)(sl->buf + sl->filled);
+  sqe->len = sl->len - sl->filled;
+  sqe->off = off + sl->filled;
+  sqe->user_data = i;
+  return 0;
+}
+
+// Read the compressed file through s, feeding completed chunks to the worker.
+static int gz_read(gz_pipe *p, struct submitter *s, int fd, off_t file_sz) {
+  long long issued = 0;
+  int inflight = 0;
+  off_t offs[GZ_DEPTH];
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> guard(p->lock);
+      while (!p->failed && issued < p->nchunks &&
+             p->slots[issued % GZ_DEPTH].state == GZ_FREE) {
+        int i = issued % GZ_DEPTH;
+        struct gz_slot *sl = &p->slots[i];
+        offs[i] = issued * (off_t)GZ_CHUNK;
+        sl->len = file_sz - offs[i] < GZ_CHUNK ? file_sz - offs[i] : GZ_CHUNK;
+        sl->filled = 0;
+        if (gz_prep_read(s, fd, sl, offs[i], i) < 0) {
+          perror("app_get_sqe");
+          p->err = errno;
+          p->failed = true;
+          p->cv.notify_all();
+          break;
+        }
+        sl->state = GZ_INFLIGHT;
+        issued++;
+        inflight++;
+      }
+      if (inflight == 0) {
+        if (p->failed || issued == p->nchunks)
+          break;
+        p->cv.wait(guard); // Every buffer is waiting to be inflated.
+        continue;
+      }
+    }
+
+    struct io_uring_cqe *cqe;
+    if (app_submit_and_wait(s, 1) < 0 || app_wait_cqe(s, &cqe) < 0)
+      return -1;
+    do {
+      int i = (int)cqe->user_data;
+      int res = cqe->res;
+      struct gz_slot *sl = &p->slots[i];
+      app_cqe_seen(s);
+      inflight--;
+      if (res > 0 && sl->filled + res < sl->len) {
+        sl->filled += res;
+        if ((res = gz_prep_read(s, fd, sl, offs[i], i)) == 0) {
+          inflight++;
+          continue;
+        }
+      }
+      std::lock_guard<std::mutex> guard(p->lock);
+      if (res < 0) {
+        errno = -res;
+        perror("read");
+        if (!p->failed)
+          p->err = -res;
+        p->failed = true;
+      } else {
+        sl->filled += res;
+        sl->state = GZ_READY;
+      }
+      p->cv.notify_all();
+    } while (app_peek_cqe(s, &cqe) == 0);
+  }
+
+  // Nothing may land in a buffer after it is freed.
+  while (inflight > 0) {
+    struct io_uring_cqe *cqe;
+    if (app_wait_cqe(s, &cqe) < 0)
+      return -1;
+    app_cqe_seen(s);
+    inflight--;
+  }
+  return p->failed ? -1 : 0;
+}
+
+// Decompress fd (gzip, or zlib) into a file_info of BLOCK_SZ blocks, queued
+// on s with my_blocks_info().
+file_info *my_gz_inflate(struct submitter *s, int fd, off_t file_sz,
+                         int *blocks) {
+  gz_pipe p;
+  p.nchunks = (file_sz + GZ_CHUNK - 1) / GZ_CHUNK;
+  p.failed = false;
+  p.err = ENOMEM; // Until the threads start, only allocations can fail
+  p.last_fill = 0;
+  p.mid_member = p.ended = p.padding = false;
+  memset(&p.zs, 0, sizeof(p.zs));
+  if (inflateInit2(&p.zs, 15 + 32) != Z_OK) { // Auto-detect gzip or zlib
+    fprintf(stderr, "inflateInit2 failed\n");
+    errno = ENOMEM;
+    return NULL;
+  }
+  int nslots = 0;
+  for (; nslots < GZ_DEPTH; nslots++) {
+    p.slots[nslots].state = GZ_FREE;
+    if (posix_memalign((void **)&p.slots[nslots].buf, BLOCK_SZ, GZ_CHUNK))
+      break;
+  }
+
+  int ret = -1;
+  if (nslots == GZ_DEPTH && gz_out_block(&p) == 0) {
+    p.err = EIO;
+    std::thread worker(gz_worker, &p);
+    ret = gz_read(&p, s, fd, file_sz);
+    if (ret < 0) {
+      std::lock_guard<std::mutex> guard(p.lock);
+      p.failed = true;
+      p.cv.notify_all();
+    }
+    worker.join();
+    if (p.failed)
+      ret = -1;
+  }
+  inflateEnd(&p.zs);
+  while (nslots--)
+    free(p.slots[nslots].buf);
+
+  // The last block may have been started just before the input ran out.
+  if (ret == 0 && p.last_fill == 0) {
+    free(p.blocks.back());
+    p.blocks.pop_back();
+    p.last_fill = BLOCK_SZ;
+  }
+  if (ret < 0) {
+    for (size_t i = 0; i < p.blocks.size(); i++)
+      free(p.blocks[i]);
+    errno = p.err;
+    return NULL;
+  }
+  *blocks = (int)p.blocks.size();
+  file_info *fi = my_blocks_info(s, p.blocks.data(), *blocks, p.last_fill);
+  for (size_t i = 0; !fi && i < p.blocks.size(); i++)
+    free(p.blocks[i]);
+  return fi;
+}
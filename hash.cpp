@@ -0,0 +1,281 @@
+#include "my_io.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * File hashes. my_hash_file() is a tree hash: every RANGE_CHUNK_SZ leaf is
+ * hashed with my_hash64() as the parallel range reader delivers it, seeded
+ * with its offset, and the root is the hash of the leaf hashes. Leaves sit at
+ * fixed offsets, so the result does not depend on the thread count.
+ *
+ * SHA-256 cannot be split that way and still match sha256sum, so
+ * my_sha256_file() runs one digest over the ordered stream of my_ropen().
+ * CRC32C can: chunk CRCs are joined with my_crc32c_combine() into the CRC of
+ * the whole file.
+ */
+struct hash_leaves {
+  std::vector<uint64_t> h;
+};
+
+// Size of a file, or of a block device, which stat() reports as 0.
+static off_t hash_size(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror(filename);
+    return -1;
+  }
+  off_t size = get_file_size(fd);
+  close(fd);
+  return size;
+}
+
+static int hash_leaf(const char *data, size_t len, off_t off, int range,
+                     void *arg) {
+  hash_leaves *l = static_cast<hash_leaves *>(arg);
+  size_t i = off / RANGE_CHUNK_SZ;
+  (void)range;
+  if (i >= l->h.size())
+    return 1; // The file grew under us; hash what was there at the start.
+  l->h[i] = my_hash64(data, len, off);
+  return 0;
+}
+
+int my_hash_file(const char *filename, int threads, uint64_t *hash) {
+  off_t size = hash_size(filename);
+  if (size < 0)
+    return -1;
+  hash_leaves l;
+  l.h.resize((size + RANGE_CHUNK_SZ - 1) / RANGE_CHUNK_SZ);
+  if (my_read_ranges(filename, threads, hash_leaf, &l) < 0)
+    return -1;
+  *hash = my_hash64(l.h.data(), l.h.size() * sizeof(uint64_t), size);
+  return 0;
+}
+
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec) {
+  uint32_t sum = 0;
+  for (; vec; vec >>= 1, mat++)
+    if (vec & 1)
+      sum ^= *mat;
+  return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *mat) {
+  for (int n = 0; n < 32; n++)
+    square[n] = gf2_times(mat, mat[n]);
+}
+
+/*
+ * CRC32C of A followed by B from crc1 = CRC(A), crc2 = CRC(B) and the length
+ * of B: crc1 is pushed through len2 zero bytes by repeated squaring of the
+ * one-zero-bit operator, as zlib's crc32_combine() does.
+ */
+uint32_t my_crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2) {
+  uint32_t even[32], odd[32];
+  if (len2 == 0)
+    return crc1;
+
+  odd[0] = 0x82f63b78u;
+  for (int n = 1; n < 32; n++)
+    odd[n] = 1u << (n - 1);
+  gf2_square(even, odd); // Two zero bits
+  gf2_square(odd, even); // Four zero bits
+
+  do {
+    gf2_square(even, odd);
+    if (len2 & 1)
+      crc1 = gf2_times(even, crc1);
+    len2 >>= 1;
+    if (len2 == 0)
+      break;
+    gf2_square(odd, even);
+    if (len2 & 1)
+      crc1 = gf2_times(odd, crc1);
+    len2 >>= 1;
+  } while (len2);
+  return crc1 ^ crc2;
+}
+
+static int crc_leaf(const char *data, size_t len, off_t off, int range,
+                    void *arg) {
+  hash_leaves *l = static_cast<hash_leaves *>(arg);
+  size_t i = off / RANGE_CHUNK_SZ;
+  (void)range;
+  if (i >= l->h.size())
+    return 1;
+  l->h[i] = my_crc32c(0, data, len);
+  return 0;
+}
+
+int my_crc32c_file(const char *filename, int threads, uint32_t *crc) {
+  off_t size = hash_size(filename);
+  if (size < 0)
+    return -1;
+  hash_leaves l;
+  l.h.resize((size + RANGE_CHUNK_SZ - 1) / RANGE_CHUNK_SZ);
+  if (my_read_ranges(filename, threads, crc_leaf, &l) < 0)
+    return -1;
+  uint32_t c = 0;
+  for (size_t i = 0; i < l.h.size(); i++) {
+    off_t off = (off_t)i * RANGE_CHUNK_SZ;
+    size_t len = size - off < RANGE_CHUNK_SZ ? size - off : RANGE_CHUNK_SZ;
+    c = my_crc32c_combine(c, (uint32_t)l.h[i], len);
+  }
+  *crc = c;
+  return 0;
+}
+
+// The sidecar "<file>.crc32c" holds one line: the CRC in hex and the size.
+int my_crc32c_save(const char *filename, uint32_t crc, off_t size) {
+  std::string path = std::string(filename) + ".crc32c";
+  FILE *f = fopen(path.c_str(), "w");
+  if (!f) {
+    perror(path.c_str());
+    return -1;
+  }
+  fprintf(f, "%08x %lld\n", crc, (long long)size);
+  if (fclose(f) != 0) {
+    perror(path.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+// 1 if the sidecar agrees with crc and size, 0 if not, -1 without a sidecar.
+int my_crc32c_check(const char *filename, uint32_t crc, off_t size) {
+  std::string path = std::string(filename) + ".crc32c";
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f)
+    return -1;
+  unsigned saved_crc;
+  long long saved_size;
+  int n = fscanf(f, "%8x %lld", &saved_crc, &saved_size);
+  fclose(f);
+  if (n != 2) {
+    errno = EINVAL;
+    return -1;
+  }
+  return saved_crc == crc && saved_size == (long long)size;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t ror32(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_block(uint32_t *h, const unsigned char *p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+           (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ w[i - 15] >> 3;
+    uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ w[i - 2] >> 10;
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+  uint32_t e = h[4], f = h[5], g = h[6], k = h[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t s1 = ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25);
+    uint32_t t1 = k + s1 + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    uint32_t s0 = ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22);
+    uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+    k = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+  h[5] += f;
+  h[6] += g;
+  h[7] += k;
+}
+
+void my_sha256_init(my_sha256 *c) {
+  static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                 0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                 0x1f83d9ab, 0x5be0cd19};
+  memcpy(c->h, iv, sizeof(iv));
+  c->len = 0;
+  c->nbuf = 0;
+}
+
+void my_sha256_update(my_sha256 *c, const void *data, size_t len) {
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  c->len += len;
+  if (c->nbuf) {
+    size_t n = len < 64 - c->nbuf ? len : 64 - c->nbuf;
+    memcpy(c->buf + c->nbuf, p, n);
+    c->nbuf += n;
+    p += n;
+    len -= n;
+    if (c->nbuf < 64)
+      return;
+    sha256_block(c->h, c->buf);
+    c->nbuf = 0;
+  }
+  for (; len >= 64; p += 64, len -= 64)
+    sha256_block(c->h, p);
+  memcpy(c->buf, p, len);
+  c->nbuf = len;
+}
+
+void my_sha256_final(my_sha256 *c, unsigned char out[32]) {
+  uint64_t bits = c->len * 8;
+  unsigned char pad[72] = {0x80};
+  size_t n = (c->nbuf < 56 ? 56 : 120) - c->nbuf;
+  for (int i = 0; i < 8; i++)
+    pad[n + i] = bits >> (56 - 8 * i);
+  my_sha256_update(c, pad, n + 8);
+  for (int i = 0; i < 8; i++) {
+    out[4 * i] = c->h[i] >> 24;
+    out[4 * i + 1] = c->h[i] >> 16;
+    out[4 * i + 2] = c->h[i] >> 8;
+    out[4 * i + 3] = c->h[i];
+  }
+}
+
+int my_sha256_file(const char *filename, int threads, unsigned char out[32]) {
+  my_range_reader *rr = my_ropen(filename, threads);
+  if (!rr)
+    return -1;
+  my_sha256 c;
+  const char *data;
+  ssize_t n;
+  my_sha256_init(&c);
+  while ((n = my_rview(rr, &data)) > 0)
+    my_sha256_update(&c, data, n);
+  my_rclose(rr);
+  if (n < 0) {
+    perror(filename);
+    return -1;
+  }
+  my_sha256_final(&c, out);
+  return 0;
+}
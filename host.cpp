@@ -1,11 +1,14 @@
 #include "my_io.h"
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <fcntl.h>
 #include <iostream>
+#include <linux/capability.h>
 #include <linux/fs.h>
+#include <linux/ioprio.h>
 #include <memory>
 #include <omp.h>
 #include <stdatomic.h>
@@ -15,6 +18,9 @@
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <unistd.h>
+#include <vector>
+
+#define FOPEN_CANCEL (MY_TIMEOUT_DATA - 1) // user_data of my_fclose()'s cancel
 
 int io_uring_setup(unsigned entries, struct io_uring_params *p) {
   return (int)syscall(__NR_io_uring_setup, entries, p);
@@ -37,9 +43,62 @@ off_t get_file_size(int fd) {
     perror("fstat");
     return -1;
   }
+  if (S_ISBLK(st.st_mode)) {
+    unsigned long long bytes;
+    if (ioctl(fd, BLKGETSIZE64, &bytes) != 0) {
+      perror("ioctl");
+      return -1;
+    }
+    return bytes;
+  }
   return st.st_size;
 }
 
+/*
+ * Sector sizes for O_DIRECT: a device's logical sector is the smallest
+ * aligned unit it accepts, its physical sector the one it writes without a
+ * read-modify-write. Files report their filesystem block for both.
+ */
+int my_sector_sizes(int fd, unsigned *logical, unsigned *physical) {
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    return -1;
+  if (!S_ISBLK(st.st_mode)) {
+    *logical = *physical = st.st_blksize;
+    return 0;
+  }
+  int lss;
+  unsigned int pss;
+  if (ioctl(fd, BLKSSZGET, &lss) != 0 || ioctl(fd, BLKPBSZGET, &pss) != 0)
+    return -1;
+  *logical = lss;
+  *physical = pss;
+  return 0;
+}
+
+/*
+ * sqe->ioprio for a priority class. The realtime class takes CAP_SYS_NICE or
+ * CAP_SYS_ADMIN, and the kernel fails reads that ask for it without one, so
+ * without them it becomes the highest best-effort level instead.
+ */
+unsigned short my_ioprio(int prio) {
+  switch (prio) {
+  case MY_PRIO_RT: {
+    struct __user_cap_header_struct hdr = {_LINUX_CAPABILITY_VERSION_3, 0};
+    struct __user_cap_data_struct data[2];
+    if (syscall(SYS_capget, &hdr, data) == 0 &&
+        (data[0].effective & (1u << CAP_SYS_NICE | 1u << CAP_SYS_ADMIN)))
+      return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_RT, 4);
+    return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 0);
+  }
+  case MY_PRIO_BE:
+    return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 4);
+  case MY_PRIO_IDLE:
+    return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+  }
+  return 0;
+}
+
 void update_file_size(my_file *mf) {
   if (mf && mf->fd >= 0) {
     off_t file_size =
@@ -54,31 +113,182 @@ void update_file_size(my_file *mf) {
   }
 }
 
+// Pipes, FIFOs, ttys and files such as those in /proc report no size.
+static bool is_stream(int fd) {
+  struct stat st;
+  return fstat(fd, &st) == 0 && !S_ISBLK(st.st_mode) &&
+         (!S_ISREG(st.st_mode) || st.st_size == 0);
+}
+
+/*
+ * Queue a NOP carrying a file_info over the n BLOCK_SZ blocks, the last one
+ * holding last_fill bytes, so the completion my_fread() waits for looks the
+ * same as for the READV of a plain file. On failure the blocks are still the
+ * caller's.
+ */
+file_info *my_blocks_info(struct submitter *s, void **blocks, int n,
+                          size_t last_fill) {
+  file_info *fi = static_cast<file_info *>(
+      omp_alloc(sizeof(*fi) + sizeof(struct iovc) * n,
+                llvm_omp_target_shared_mem_alloc));
+  if (!fi) {
+    fprintf(stderr, "Unable to allocate memory\n");
+    return NULL;
+  }
+  fi->file_sz = n ? (long long)(n - 1) * BLOCK_SZ + last_fill : 0;
+  for (int i = 0; i < n; i++) {
+    fi->iovecs[i].buffer = blocks[i];
+    fi->iovecs[i].buffer_size = i + 1 < n ? BLOCK_SZ : last_fill;
+  }
+
+  struct io_uring_sqe *sqe = app_get_sqe(s);
+  if (!sqe) {
+    omp_free(fi, llvm_omp_target_shared_mem_alloc);
+    return NULL;
+  }
+  sqe->opcode = IORING_OP_NOP;
+  sqe->user_data = (unsigned long long)fi;
+  if (app_submit(s) < 0) {
+    omp_free(fi, llvm_omp_target_shared_mem_alloc);
+    return NULL;
+  }
+  return fi;
+}
+
+// Read a stream to its end through a pipeline, into BLOCK_SZ blocks.
+static file_info *stream_collect(struct submitter *s, int fd, int *nblocks) {
+  int pfd = dup(fd);
+  my_pipeline *pl = pfd < 0 ? NULL : my_pipe_fdopen(pfd);
+  if (!pl || my_pipe_start(pl) < 0) {
+    perror("stream");
+    if (pl)
+      my_pipe_close(pl);
+    else if (pfd >= 0)
+      close(pfd);
+    return NULL;
+  }
+
+  std::vector<void *> blocks;
+  size_t fill = BLOCK_SZ;
+  const char *data;
+  ssize_t n;
+  while ((n = my_pipe_view(pl, &data)) > 0) {
+    while (n > 0) {
+      if (fill == BLOCK_SZ) {
+        void *buf;
+        if (posix_memalign(&buf, BLOCK_SZ, BLOCK_SZ)) {
+          errno = ENOMEM;
+          n = -1;
+          break;
+        }
+        blocks.push_back(buf);
+        fill = 0;
+      }
+      size_t len = (size_t)n < BLOCK_SZ - fill ? n : BLOCK_SZ - fill;
+      memcpy((char *)blocks.back() + fill, data, len);
+      fill += len;
+      data += len;
+      n -= len;
+    }
+    if (n < 0)
+      break;
+  }
+  if (n < 0) {
+    perror("stream");
+    my_pipe_close(pl);
+    for (size_t i = 0; i < blocks.size(); i++)
+      free(blocks[i]);
+    return NULL;
+  }
+  my_pipe_close(pl);
+  *nblocks = (int)blocks.size();
+  file_info *fi = my_blocks_info(s, blocks.data(), *nblocks, fill);
+  for (size_t i = 0; !fi && i < blocks.size(); i++)
+    free(blocks[i]);
+  return fi;
+}
+
+/*
+ * The mmap engine: the blocks are windows on one shared mapping, so my_fread()
+ * copies straight out of the page cache and my_fview() hands out the mapping
+ * itself. The access pattern picks the madvise(2) hints.
+ */
+static file_info *mmap_blocks(struct submitter *s, int fd, off_t file_sz,
+                              int fl, int *nblocks, void **map) {
+  void *p = mmap(NULL, file_sz, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+  madvise(p, file_sz, fl & MY_FOPEN_RANDOM ? MADV_RANDOM : MADV_SEQUENTIAL);
+  if (fl & MY_FOPEN_HOT)
+    madvise(p, file_sz, MADV_WILLNEED);
+  // Only taken where the filesystem supports large folios or read-only THP.
+  if (fl & MY_FOPEN_HUGEPAGE)
+    madvise(p, file_sz, MADV_HUGEPAGE);
+
+  int n = (file_sz + BLOCK_SZ - 1) / BLOCK_SZ;
+  std::vector<void *> blocks(n);
+  for (int i = 0; i < n; i++)
+    blocks[i] = (char *)p + (size_t)i * BLOCK_SZ;
+  file_info *fi =
+      my_blocks_info(s, blocks.data(), n, file_sz - (off_t)(n - 1) * BLOCK_SZ);
+  if (!fi) {
+    munmap(p, file_sz);
+    return NULL;
+  }
+  *nblocks = n;
+  *map = p;
+  return fi;
+}
+
+// "rm" opens with the mmap engine for a sequential read.
 my_file *my_fopen(const char *filename, const char *mode) {
+  if (strcmp(mode, "rm") == 0)
+    return my_fopen_ex(filename, "r", MY_FOPEN_MMAP);
+  return my_fopen_ex(filename, mode, 0);
+}
+
+my_file *my_fopen_ex(const char *filename, const char *mode, int fl) {
+  return my_fopen_timed(filename, mode, fl, 0);
+}
+
+/*
+ * my_fopen_ex() with a deadline on each read of the ring and MY_FOPEN_PREAD
+ * engines: one still in flight after timeout_sec is cancelled and fails with
+ * ETIMEDOUT. 0 waits for as long as the read takes.
+ */
+my_file *my_fopen_timed(const char *filename, const char *mode, int fl,
+                        double timeout_sec) {
   struct submitter *s = static_cast<struct submitter *>(
       omp_alloc(sizeof(struct submitter), llvm_omp_target_shared_mem_alloc));
   struct file_info *fi;
-  int flags = (strcmp(mode, "r") == 0) ? O_RDONLY : O_RDWR;
-  if (app_setup_uring(s)) {
+  int flags = (mode[0] == 'r' && !strchr(mode, '+')) ? O_RDONLY : O_RDWR;
+  // Positioned reads wait on each read in turn, which a polling thread only
+  // slows down.
+  int ring = (fl & MY_FOPEN_PREAD)
+                 ? app_setup_uring_ex(s, QUEUE_DEPTH, 0)
+                 : app_setup_uring(s);
+  if (ring) {
     fprintf(stderr, "Unable to setup uring!\n");
     free(s);
     return NULL;
   }
 
-  int fd = open(filename, flags);
+  // "-" is stdin, on a descriptor of its own as my_fclose() closes it.
+  int fd = strcmp(filename, "-") == 0 ? dup(STDIN_FILENO) : open(filename, flags);
   if (fd < 0) {
     printf("Fopen failed.");
     return NULL;
   }
 
-  struct app_io_sq_ring *sring = &s->sq_ring;
-  unsigned index = 0, current_block = 0, tail = 0, next_tail = 0;
+  unsigned current_block = 0;
 
   off_t file_sz = get_file_size(fd);
   if (file_sz < 0)
     return NULL;
   off_t bytes_remaining = file_sz;
-  int blocks = (int)file_sz / BLOCK_SZ;
+  int blocks = (int)(file_sz / BLOCK_SZ);
   if (file_sz % BLOCK_SZ)
     blocks++;
 
@@ -90,14 +300,49 @@ my_file *my_fopen(const char *filename, const char *mode) {
     return NULL;
   }
 
-  fi = static_cast<struct file_info *>(
-      omp_alloc(sizeof(*fi) + sizeof(struct iovec) * blocks,
-                llvm_omp_target_shared_mem_alloc));
-  if (!fi) {
-    fprintf(stderr, "Unable to allocate memory\n");
-    return NULL;
+  // "rz" forces the inflate stage, plain "r" takes it for gzip magic.
+  // Inputs without a size are read to their end first.
+  bool compressed = strcmp(mode, "rz") == 0 ||
+                    (strcmp(mode, "r") == 0 && my_gz_detect(fd));
+  bool stream = !compressed && is_stream(fd);
+  bool mapped = !compressed && !stream && (fl & MY_FOPEN_MMAP) && file_sz > 0;
+  // The positioned engine reads nothing here; my_pread() reads on demand.
+  bool lazy = !compressed && !stream && !mapped && (fl & MY_FOPEN_PREAD);
+  void *map = NULL;
+  my_readahead *ra = NULL;
+  if (lazy) {
+    fi = static_cast<struct file_info *>(
+        omp_alloc(sizeof(*fi), llvm_omp_target_shared_mem_alloc));
+    ra = fi ? my_ra_open(file_sz, timeout_sec) : NULL;
+    if (!ra) {
+      if (fi)
+        omp_free(fi, llvm_omp_target_shared_mem_alloc);
+      close(fd);
+      return NULL;
+    }
+    fi->file_sz = file_sz;
+    blocks = 0;
+  } else if (compressed || stream || mapped) {
+    if (compressed)
+      fi = my_gz_inflate(s, fd, file_sz, &blocks);
+    else if (stream)
+      fi = stream_collect(s, fd, &blocks);
+    else
+      fi = mmap_blocks(s, fd, file_sz, fl, &blocks, &map);
+    if (!fi) {
+      close(fd);
+      return NULL;
+    }
+  } else {
+    fi = static_cast<struct file_info *>(
+        omp_alloc(sizeof(*fi) + sizeof(struct iovec) * blocks,
+                  llvm_omp_target_shared_mem_alloc));
+    if (!fi) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      return NULL;
+    }
+    fi->file_sz = file_sz;
   }
-  fi->file_sz = file_sz;
   my_file *mf = static_cast<my_file *>(
       omp_alloc(sizeof(my_file), llvm_omp_target_shared_mem_alloc));
   mf->s = s;
@@ -106,9 +351,22 @@ my_file *my_fopen(const char *filename, const char *mode) {
   mf->blocks = blocks;
   mf->current_block = 0;
   mf->current_offset = 0;
-  mf->isfirst = 0;
-
-  while (bytes_remaining) {
+  mf->isfirst = lazy; // No completion to wait for
+  mf->fi_read = fi;
+  mf->line_buf = NULL;
+  mf->line_cap = 0;
+  mf->map = map;
+  mf->map_sz = map ? file_sz : 0;
+  mf->ra = ra;
+  mf->pread = lazy ? my_pread : NULL;
+  mf->err = 0;
+  mf->ioprio = my_ioprio(fl & MY_FOPEN_PRIO_RT     ? MY_PRIO_RT
+                         : fl & MY_FOPEN_PRIO_BE   ? MY_PRIO_BE
+                         : fl & MY_FOPEN_PRIO_IDLE ? MY_PRIO_IDLE
+                                                   : MY_PRIO_NONE);
+
+  bool queued = compressed || stream || mapped || lazy;
+  while (!queued && bytes_remaining) {
     off_t bytes_to_read = bytes_remaining;
     if (bytes_to_read > BLOCK_SZ)
       bytes_to_read = BLOCK_SZ;
@@ -126,34 +384,30 @@ my_file *my_fopen(const char *filename, const char *mode) {
     bytes_remaining -= bytes_to_read;
   }
 
-  /* Add our submission queue entry to the tail of the SQE ring buffer */
-  next_tail = tail = *sring->tail;
-  next_tail++;
-  read_barrier();
-  index = tail & *s->sq_ring.ring_mask;
-  struct io_uring_sqe *sqe = &s->sqes[index];
-  sqe->fd = fd;
-  sqe->flags = 0;
-  sqe->opcode = IORING_OP_READV;
-  sqe->addr = (unsigned long)fi->iovecs;
-  sqe->len = blocks;
-  sqe->off = 0;
-  sqe->user_data = (unsigned long long)fi;
-  sring->array[index] = index;
-  tail = next_tail;
-
-  if (*sring->tail != tail) {
-    *sring->tail = tail;
-    write_barrier();
-  }
-
-  if ((*sring->flags) & IORING_SQ_NEED_WAKEUP) {
-    systemTimes++;
-    int ret = io_uring_enter(s->ring_fd, 1, 1, IORING_ENTER_SQ_WAKEUP);
-    if (ret < 0) {
-      perror("io_uring_enter");
+  // The other engines have queued their completion already. The timeout
+  // is read when the poller takes the READV, which is before it can
+  // complete, so it can live on the stack.
+  struct __kernel_timespec ts;
+  if (!queued) {
+    struct io_uring_sqe *sqe = app_get_sqe(s);
+    if (!sqe) {
+      perror("app_get_sqe");
       return NULL;
     }
+    sqe->fd = fd;
+    sqe->opcode = IORING_OP_READV;
+    sqe->ioprio = mf->ioprio;
+    sqe->addr = (unsigned long)fi->iovecs;
+    sqe->len = blocks;
+    sqe->off = 0;
+    sqe->user_data = (unsigned long long)fi;
+    if (timeout_sec > 0 &&
+        app_link_timeout(s, sqe, &ts, timeout_sec, MY_TIMEOUT_DATA) < 0) {
+      perror("app_link_timeout");
+      return NULL;
+    }
+    if (app_submit(s) < 0)
+      return NULL;
   }
 
   // Update tail pointer value.
@@ -173,22 +427,54 @@ void my_fclose(my_file *mf) {
     return; // If the pointer is NULL, no deallocation is needed.
   }
 
+  // Read-ahead in flight lands in buffers my_ra_close() frees.
+  my_ra_close(mf);
+
+  // Nor may the READV, if it was never waited for: cancel it, and let the
+  // blocks go only once it and the cancel have completed.
+  if (!mf->isfirst && mf->s) {
+    bool cancelling = app_cancel(mf->s, (unsigned long long)mf->fi_read,
+                                 false, FOPEN_CANCEL) == 0;
+    bool read_done = false;
+    struct io_uring_cqe *cqe;
+    while ((!read_done || cancelling) && app_wait_cqe(mf->s, &cqe) == 0) {
+      if (cqe->user_data == (unsigned long long)mf->fi_read)
+        read_done = true;
+      else if (cqe->user_data == FOPEN_CANCEL)
+        cancelling = false;
+      app_cqe_seen(mf->s);
+    }
+  }
+
   // Close the file descriptor if open.
   if (mf->fd >= 0) {
     close(mf->fd);
     mf->fd = -1;
   }
 
+  // The blocks the engines read into; the mmap engine's are views on the
+  // mapping.
+  for (int i = 0; mf->fi && !mf->map && i < mf->blocks; i++)
+    free(mf->fi->iovecs[i].buffer);
+
   // Free the file_info structure.
   if (mf->fi) {
     omp_free(mf->fi, llvm_omp_target_shared_mem_alloc);
     mf->fi = NULL;
   }
 
+  free(mf->line_buf);
+  mf->line_buf = NULL;
+
+  // The mmap engine's blocks are views on the mapping.
+  if (mf->map) {
+    munmap(mf->map, mf->map_sz);
+    mf->map = NULL;
+  }
+
   // Free the submitter structure and any associated resources.
   if (mf->s) {
-    // Continue similarly for other mmap'ed or allocated regions within
-    // submitter if any.
+    app_teardown_uring(mf->s);
     omp_free(mf->s, llvm_omp_target_shared_mem_alloc);
     mf->s = NULL;
   }
@@ -200,6 +486,11 @@ void my_fclose(my_file *mf) {
 }
 
 int app_setup_uring(struct submitter *s) {
+  return app_setup_uring_ex(s, QUEUE_DEPTH,
+                            IORING_SETUP_SQPOLL | IORING_SETUP_SQ_AFF);
+}
+
+int app_setup_uring_ex(struct submitter *s, unsigned entries, unsigned flags) {
   memset(s, 0, sizeof(*s));
   struct app_io_sq_ring *sring = &s->sq_ring;
   struct app_io_cq_ring *cring = &s->cq_ring;
@@ -207,14 +498,15 @@ int app_setup_uring(struct submitter *s) {
   void *sq_ptr, *cq_ptr;
 
   memset(&p, 0, sizeof(p));
-  p.flags |= IORING_SETUP_SQPOLL;
-  p.flags |= IORING_SETUP_SQ_AFF;
-  p.sq_thread_idle = 20000000;
-  s->ring_fd = io_uring_setup(QUEUE_DEPTH, &p);
+  p.flags = flags;
+  if (flags & IORING_SETUP_SQPOLL)
+    p.sq_thread_idle = 20000000;
+  s->ring_fd = io_uring_setup(entries, &p);
   if (s->ring_fd < 0) {
     perror("io_uring_setup");
     return 1;
   }
+  s->setup_flags = p.flags;
 
   int sring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
   int cring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
@@ -250,6 +542,13 @@ int app_setup_uring(struct submitter *s) {
   sring->ring_entries = (unsigned *)((char *)sq_ptr + p.sq_off.ring_entries);
   sring->flags = (unsigned *)((char *)sq_ptr + p.sq_off.flags);
   sring->array = (unsigned *)((char *)sq_ptr + p.sq_off.array);
+  s->sq_tail = *sring->tail;
+  s->sq_ptr = sq_ptr;
+  s->sq_sz = sring_sz;
+  if (cq_ptr != sq_ptr) {
+    s->cq_ptr = cq_ptr;
+    s->cq_sz = cring_sz;
+  }
 
   s->sqes = (struct io_uring_sqe *)mmap(
       0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
@@ -258,6 +557,7 @@ int app_setup_uring(struct submitter *s) {
     perror("mmap");
     return 1;
   }
+  s->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
 
   cring->head = (unsigned *)((char *)cq_ptr + p.cq_off.head);
   cring->tail = (unsigned *)((char *)cq_ptr + p.cq_off.tail);
@@ -267,3 +567,203 @@ int app_setup_uring(struct submitter *s) {
 
   return 0;
 }
+
+void app_teardown_uring(struct submitter *s) {
+  if (s->sqes && s->sqes != MAP_FAILED)
+    munmap(s->sqes, s->sqes_sz);
+  if (s->cq_ptr)
+    munmap(s->cq_ptr, s->cq_sz);
+  if (s->sq_ptr)
+    munmap(s->sq_ptr, s->sq_sz);
+  if (s->ring_fd >= 0)
+    close(s->ring_fd);
+  s->sqes = NULL;
+  s->sq_ptr = s->cq_ptr = NULL;
+  s->ring_fd = -1;
+}
+
+static int app_enter(struct submitter *s, unsigned to_submit,
+                     unsigned wait_nr, unsigned flags) {
+  int ret;
+  do {
+    systemTimes++;
+    s->stats.enters++;
+    ret = io_uring_enter(s->ring_fd, to_submit, wait_nr, flags);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0) {
+    perror("io_uring_enter");
+    return -errno;
+  }
+  return ret;
+}
+
+/*
+ * Make room in a full SQ ring: flush what is staged, and with SQPOLL sleep
+ * in IORING_ENTER_SQ_WAIT until the poller has taken entries.
+ */
+static int app_sq_wait(struct submitter *s) {
+  struct app_io_sq_ring *sring = &s->sq_ring;
+  unsigned head = __atomic_load_n(sring->head, __ATOMIC_ACQUIRE);
+  s->stats.full++;
+  int ret = app_submit(s);
+  if (ret < 0)
+    return ret;
+  if (__atomic_load_n(sring->head, __ATOMIC_ACQUIRE) != head)
+    return 0;
+  if (!(s->setup_flags & IORING_SETUP_SQPOLL))
+    return -EBUSY; // The kernel took none: its CQ ring is overflowing
+  ret = app_enter(s, 0, 0, IORING_ENTER_SQ_WAIT);
+  return ret < 0 ? ret : 0;
+}
+
+/*
+ * Reserve the next free SQE. It is staged here and becomes visible to the
+ * kernel, with everything staged since the last flush, on the next
+ * app_submit(). A full ring is flushed to make room, so the caller blocks
+ * rather than overwriting entries. Returns NULL, with errno set, only when
+ * that fails.
+ */
+struct io_uring_sqe *app_get_sqe(struct submitter *s) {
+  struct app_io_sq_ring *sring = &s->sq_ring;
+  while (s->sq_tail - __atomic_load_n(sring->head, __ATOMIC_ACQUIRE) >=
+         *sring->ring_entries) {
+    int ret = app_sq_wait(s);
+    if (ret < 0) {
+      errno = -ret;
+      return NULL;
+    }
+  }
+
+  unsigned index = s->sq_tail & *sring->ring_mask;
+  struct io_uring_sqe *sqe = &s->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sring->array[index] = index;
+  s->sq_tail++;
+  return sqe;
+}
+
+/*
+ * Flush: publish every SQE staged since the last flush with one release store
+ * of the tail, and enter the kernel if it has to be told or wait_nr
+ * completions are wanted. Returns the SQEs submitted.
+ */
+int app_submit_and_wait(struct submitter *s, unsigned wait_nr) {
+  struct app_io_sq_ring *sring = &s->sq_ring;
+  unsigned to_submit = s->sq_tail - *sring->tail;
+  unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+
+  if (to_submit)
+    __atomic_store_n(sring->tail, s->sq_tail, __ATOMIC_RELEASE);
+
+  if (s->setup_flags & IORING_SETUP_SQPOLL) {
+    s->stats.submitted += to_submit;
+    // The poller thread picks the entries up; only wake it if it sleeps.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(sring->flags, __ATOMIC_RELAXED) &
+        IORING_SQ_NEED_WAKEUP)
+      flags |= IORING_ENTER_SQ_WAKEUP;
+    if (!(flags & (IORING_ENTER_SQ_WAKEUP | IORING_ENTER_GETEVENTS)))
+      return (int)to_submit;
+    to_submit = 0;
+  } else {
+    // Everything the kernel has not taken yet, including what a short
+    // submit left behind.
+    to_submit = s->sq_tail - __atomic_load_n(sring->head, __ATOMIC_ACQUIRE);
+    if (!to_submit && !wait_nr)
+      return 0;
+  }
+
+  int ret = app_enter(s, to_submit, wait_nr, flags);
+  if (ret > 0 && to_submit)
+    s->stats.submitted += ret;
+  return ret;
+}
+
+int app_submit(struct submitter *s) { return app_submit_and_wait(s, 0); }
+
+int app_peek_cqe(struct submitter *s, struct io_uring_cqe **cqe) {
+  struct app_io_cq_ring *cring = &s->cq_ring;
+  unsigned head = *cring->head;
+  if (head == __atomic_load_n(cring->tail, __ATOMIC_ACQUIRE))
+    return -EAGAIN;
+  *cqe = &cring->cqes[head & *cring->ring_mask];
+  return 0;
+}
+
+int app_wait_cqe(struct submitter *s, struct io_uring_cqe **cqe) {
+  while (app_peek_cqe(s, cqe) < 0) {
+    int ret = app_submit_and_wait(s, 1);
+    if (ret < 0)
+      return ret;
+  }
+  return 0;
+}
+
+void app_cqe_seen(struct submitter *s) {
+  struct app_io_cq_ring *cring = &s->cq_ring;
+  __atomic_store_n(cring->head, *cring->head + 1, __ATOMIC_RELEASE);
+}
+
+static void app_timespec(struct __kernel_timespec *ts, double sec) {
+  ts->tv_sec = (long long)sec;
+  ts->tv_nsec = (long long)((sec - ts->tv_sec) * 1e9);
+}
+
+// Queue a timer that completes with -ETIME after sec; *ts has to stay put
+// until it is submitted.
+int app_prep_timeout(struct submitter *s, struct __kernel_timespec *ts,
+                     double sec, unsigned long long user_data) {
+  struct io_uring_sqe *sqe = app_get_sqe(s);
+  if (!sqe)
+    return -1;
+  app_timespec(ts, sec);
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (unsigned long)ts;
+  sqe->len = 1;
+  sqe->off = 0; // Pure timer: no completion count
+  sqe->user_data = user_data;
+  return 0;
+}
+
+/*
+ * Bound the request in sqe, the last one queued, to sec: if it is still in
+ * flight by then it completes with -ECANCELED. The timeout completes too,
+ * with -ETIME when it fired and -ECANCELED when the request beat it. *ts has
+ * to stay put until it is submitted.
+ */
+int app_link_timeout(struct submitter *s, struct io_uring_sqe *sqe,
+                     struct __kernel_timespec *ts, double sec,
+                     unsigned long long user_data) {
+  struct io_uring_sqe *link = app_get_sqe(s);
+  if (!link)
+    return -1;
+  app_timespec(ts, sec);
+  sqe->flags |= IOSQE_IO_LINK;
+  link->opcode = IORING_OP_LINK_TIMEOUT;
+  link->fd = -1;
+  link->addr = (unsigned long)ts;
+  link->len = 1;
+  link->user_data = user_data;
+  return 0;
+}
+
+/*
+ * Queue an IORING_OP_ASYNC_CANCEL of the request with target's user_data, or
+ * with all set of every request in flight on the ring (Linux 5.19; older
+ * kernels fail the cancel with -EINVAL and the requests run their course).
+ * The cancel completes on its own with user_data once it has been done.
+ */
+int app_cancel(struct submitter *s, unsigned long long target, bool all,
+               unsigned long long user_data) {
+  struct io_uring_sqe *sqe = app_get_sqe(s);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  if (all)
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+  sqe->user_data = user_data;
+  return 0;
+}
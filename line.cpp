@@ -0,0 +1,160 @@
+#include "my_io.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+/*
+ * Line access on top of the blocks my_fopen() reads. A line that sits inside
+ * one block is returned in place; one that crosses a block boundary is
+ * stitched into mf->line_buf. my_fview() hands out the blocks themselves.
+ */
+
+// Consume the READV completion once, the way my_fread() does on first use.
+// The MY_FOPEN_PREAD engine has no blocks to hand out.
+int my_fready(my_file *mf) {
+  if (mf->ra) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (mf->err) {
+    errno = mf->err;
+    return -1;
+  }
+  if (mf->isfirst)
+    return 0;
+
+  struct app_io_cq_ring *cring = &mf->s->cq_ring;
+  struct io_uring_cqe *cqe;
+  for (;;) {
+    while (*cring->head == __atomic_load_n(cring->tail, __ATOMIC_ACQUIRE)) {
+      __asm volatile("pause" ::: "memory");
+    }
+    cqe = &cring->cqes[*cring->head & *cring->ring_mask];
+    if (cqe->user_data != MY_TIMEOUT_DATA)
+      break;
+    app_cqe_seen(mf->s); // The READV's deadline, fired or not
+  }
+  int res = cqe->res;
+  mf->fi_read = (struct file_info *)cqe->user_data;
+  mf->isfirst = 1;
+  app_cqe_seen(mf->s);
+  if (res < 0) {
+    // Only the deadline cancels a READV that is still being waited for.
+    mf->err = res == -ECANCELED ? ETIMEDOUT : -res;
+    errno = mf->err;
+    return -1;
+  }
+  return 0;
+}
+
+// errno of the file's failed READV, after which my_fread() returns 0; 0 if
+// it did not fail.
+int my_ferror(my_file *mf) { return mf->err; }
+
+static void line_advance(my_file *mf, size_t n) {
+  mf->current_offset += n;
+  if (mf->current_offset >= mf->fi->iovecs[mf->current_block].buffer_size) {
+    mf->current_block++;
+    mf->current_offset = 0;
+  }
+}
+
+static int line_append(my_file *mf, size_t len, const char *p, size_t n) {
+  if (len + n > mf->line_cap) {
+    size_t cap = mf->line_cap ? mf->line_cap : BLOCK_SZ;
+    while (cap < len + n)
+      cap *= 2;
+    char *buf = static_cast<char *>(realloc(mf->line_buf, cap));
+    if (!buf)
+      return -1;
+    mf->line_buf = buf;
+    mf->line_cap = cap;
+  }
+  memcpy(mf->line_buf + len, p, n);
+  return 0;
+}
+
+ssize_t my_getline(const char **line, my_file *mf) {
+  size_t len = 0;
+
+  if (my_fready(mf) < 0)
+    return -1;
+
+  while (mf->current_block < mf->blocks) {
+    struct iovc *iov = &mf->fi->iovecs[mf->current_block];
+    const char *p = (const char *)iov->buffer + mf->current_offset;
+    const char *end = (const char *)iov->buffer + iov->buffer_size;
+    const char *nl = my_find_byte(p, end, '\n');
+    size_t n = (nl < end ? nl + 1 : end) - p;
+
+    if (nl < end && len == 0) {
+      *line = p;
+      line_advance(mf, n);
+      return n;
+    }
+    if (line_append(mf, len, p, n) < 0)
+      return -1;
+    len += n;
+    line_advance(mf, n);
+    if (nl < end)
+      break;
+  }
+
+  // A final line without '\n' also lands here.
+  *line = mf->line_buf;
+  return len;
+}
+
+char *my_fgets(char *str, int size, my_file *mf) {
+  size_t len = 0;
+
+  if (size <= 0 || my_fready(mf) < 0)
+    return NULL;
+
+  while (len + 1 < (size_t)size && mf->current_block < mf->blocks) {
+    struct iovc *iov = &mf->fi->iovecs[mf->current_block];
+    const char *p = (const char *)iov->buffer + mf->current_offset;
+    const char *end = (const char *)iov->buffer + iov->buffer_size;
+    if ((size_t)(end - p) > size - 1 - len)
+      end = p + (size - 1 - len);
+    const char *nl = my_find_byte(p, end, '\n');
+    size_t n = (nl < end ? nl + 1 : end) - p;
+
+    memcpy(str + len, p, n);
+    len += n;
+    line_advance(mf, n);
+    if (nl < end)
+      break;
+  }
+
+  if (len == 0)
+    return NULL;
+  str[len] = '\0';
+  return str;
+}
+
+/*
+ * Zero-copy read: *data points at the next bytes of the file and stays valid
+ * until my_fclose(). The mmap engine hands out the rest of the mapping at
+ * once, the ring engine the rest of the current block.
+ */
+ssize_t my_fview(const char **data, my_file *mf) {
+  if (my_fready(mf) < 0)
+    return -1;
+  if (mf->current_block >= mf->blocks)
+    return 0;
+
+  struct iovc *iov = &mf->fi->iovecs[mf->current_block];
+  const char *p = (const char *)iov->buffer + mf->current_offset;
+  size_t n;
+  if (mf->map) {
+    n = mf->map_sz - (p - (const char *)mf->map);
+    mf->current_block = mf->blocks;
+    mf->current_offset = 0;
+  } else {
+    n = iov->buffer_size - mf->current_offset;
+    line_advance(mf, n);
+  }
+  *data = p;
+  return n;
+}
@@ -0,0 +1,313 @@
+#include "my_io.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Sidecar line index, "<file>.lidx": a header that pins the indexed file
+ * (inode, size, mtime) followed by the byte offset of every stride-th line
+ * start. A lookup reads from the sample at or before the first wanted line
+ * to the sample after the last one, so any line range is one positioned read.
+ */
+#define LIDX_MAGIC "MYLIDX1"
+
+struct lidx_header {
+  char magic[8];
+  uint32_t stride;
+  uint32_t pad;
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t file_sz;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t lines;     // Complete ('\n'-terminated) lines
+  uint64_t tail_off;  // Just past the last '\n'
+  uint64_t nsamples;
+};
+
+struct my_line_index {
+  int fd;
+  int state;
+  submitter s;
+  void *map;
+  size_t map_sz;
+  struct lidx_header hdr;
+  const uint64_t *samples;
+  std::vector<uint64_t> own; // Used when the sidecar cannot be written
+};
+
+static bool lidx_matches_file(const struct lidx_header *h,
+                              const struct stat *st) {
+  return h->dev == (uint64_t)st->st_dev && h->ino == (uint64_t)st->st_ino;
+}
+
+static bool lidx_current(const struct lidx_header *h, const struct stat *st) {
+  return lidx_matches_file(h, st) && h->file_sz == (uint64_t)st->st_size &&
+         h->mtime_sec == st->st_mtim.tv_sec &&
+         h->mtime_nsec == st->st_mtim.tv_nsec;
+}
+
+/*
+ * Scan from hdr->tail_off to the end of the file, extending the samples. The
+ * data streams through the parallel range reader; newlines are counted a
+ * chunk at a time and only the chunks holding a sample boundary are walked.
+ */
+static int lidx_scan(const char *filename, struct lidx_header *hdr,
+                     std::vector<uint64_t> &samples) {
+  my_range_reader *rr = my_ropen_at(filename, 0, hdr->tail_off);
+  if (!rr)
+    return -1;
+
+  uint64_t off = hdr->tail_off;
+  uint64_t lines = hdr->lines;
+  const char *data;
+  ssize_t n;
+
+  while ((n = my_rview(rr, &data)) > 0) {
+    const char *p = data, *end = data + n;
+    while (p < end) {
+      // Newlines until the line that starts the next sample.
+      size_t want = hdr->stride - lines % hdr->stride;
+      size_t left = want;
+      const char *nl = my_find_nth_byte(p, end, '\n', &left);
+      lines += want - left;
+      if (nl == end) {
+        p = end;
+        break;
+      }
+      p = nl + 1;
+      samples.push_back(off + (p - data));
+    }
+    const char *last = end;
+    while (last > data && last[-1] != '\n')
+      last--;
+    if (last > data)
+      hdr->tail_off = off + (last - data);
+    off += n;
+  }
+  my_rclose(rr);
+  if (n < 0) {
+    perror(filename);
+    return -1;
+  }
+  hdr->lines = lines;
+  hdr->file_sz = off;
+  hdr->nsamples = samples.size();
+  return 0;
+}
+
+static int lidx_write(const std::string &path, const struct lidx_header *hdr,
+                      const std::vector<uint64_t> &samples) {
+  std::string tmp = path + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return -1;
+  size_t bytes = samples.size() * sizeof(uint64_t);
+  if (write(fd, hdr, sizeof(*hdr)) != (ssize_t)sizeof(*hdr) ||
+      write(fd, samples.data(), bytes) != (ssize_t)bytes || close(fd) < 0) {
+    close(fd);
+    unlink(tmp.c_str());
+    return -1;
+  }
+  // Readers see either the old index or the new one, never half of it.
+  return rename(tmp.c_str(), path.c_str());
+}
+
+static int lidx_map(my_line_index *li, const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return -1;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct lidx_header)) {
+    close(fd);
+    return -1;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  const struct lidx_header *h = (const struct lidx_header *)map;
+  if (memcmp(h->magic, LIDX_MAGIC, sizeof(LIDX_MAGIC)) != 0 ||
+      sizeof(*h) + h->nsamples * sizeof(uint64_t) > (size_t)st.st_size) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+  li->map = map;
+  li->map_sz = st.st_size;
+  li->hdr = *h;
+  li->samples = (const uint64_t *)(h + 1);
+  return 0;
+}
+
+my_line_index *my_lidx_open(const char *filename, unsigned stride) {
+  struct stat st;
+  std::string path = std::string(filename) + ".lidx";
+
+  if (stride == 0)
+    stride = LIDX_STRIDE;
+  my_line_index *li = new my_line_index();
+  li->fd = open(filename, O_RDONLY);
+  if (li->fd < 0 || fstat(li->fd, &st) < 0) {
+    perror(filename);
+    my_lidx_close(li);
+    return NULL;
+  }
+  if (app_setup_uring_ex(&li->s, 4, 0)) {
+    my_lidx_close(li);
+    return NULL;
+  }
+
+  // Only a regular file gets a sidecar; nothing is written next to a
+  // device node.
+  bool sidecar = S_ISREG(st.st_mode);
+  li->state = MY_LIDX_MAPPED;
+  if (sidecar && lidx_map(li, path) == 0 && li->hdr.stride == stride &&
+      lidx_current(&li->hdr, &st))
+    return li;
+
+  // Start over unless the old index covers a prefix of this same file.
+  std::vector<uint64_t> samples;
+  struct lidx_header hdr;
+  char last_nl = '\n';
+  if (li->map && li->hdr.tail_off > 0 &&
+      pread(li->fd, &last_nl, 1, li->hdr.tail_off - 1) != 1)
+    last_nl = 0;
+  if (li->map && li->hdr.stride == stride &&
+      lidx_matches_file(&li->hdr, &st) &&
+      li->hdr.file_sz <= (uint64_t)st.st_size && last_nl == '\n') {
+    hdr = li->hdr;
+    samples.assign(li->samples, li->samples + li->hdr.nsamples);
+    li->state = MY_LIDX_UPDATED;
+  } else {
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, LIDX_MAGIC, sizeof(LIDX_MAGIC));
+    hdr.stride = stride;
+    samples.push_back(0);
+    li->state = MY_LIDX_BUILT;
+  }
+  if (li->map) {
+    munmap(li->map, li->map_sz);
+    li->map = NULL;
+  }
+
+  hdr.dev = st.st_dev;
+  hdr.ino = st.st_ino;
+  hdr.mtime_sec = st.st_mtim.tv_sec;
+  hdr.mtime_nsec = st.st_mtim.tv_nsec;
+  if (lidx_scan(filename, &hdr, samples) < 0) {
+    my_lidx_close(li);
+    return NULL;
+  }
+
+  if (sidecar && lidx_write(path, &hdr, samples) == 0 &&
+      lidx_map(li, path) == 0)
+    return li;
+
+  // Devices, read-only directories and the like: keep the index in memory
+  // only.
+  li->hdr = hdr;
+  li->own.swap(samples);
+  li->samples = li->own.data();
+  return li;
+}
+
+int my_lidx_state(my_line_index *li) { return li->state; }
+
+// Lines in the file, counting a final line without '\n'.
+size_t my_lidx_count(my_line_index *li) {
+  return li->hdr.lines + (li->hdr.tail_off < li->hdr.file_sz ? 1 : 0);
+}
+
+static ssize_t lidx_pread(my_line_index *li, char *buf, size_t len,
+                          off_t off) {
+  size_t done = 0;
+  while (done < len) {
+    struct io_uring_sqe *sqe = app_get_sqe(&li->s);
+    struct io_uring_cqe *cqe;
+    if (!sqe)
+      return -1;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = li->fd;
+    sqe->addr = (unsigned long)(buf + done);
+    sqe->len = len - done;
+    sqe->off = off + done;
+    if (app_submit_and_wait(&li->s, 1) < 0 || app_wait_cqe(&li->s, &cqe) < 0)
+      return -1;
+    int res = cqe->res;
+    app_cqe_seen(&li->s);
+    if (res < 0) {
+      errno = -res;
+      return -1;
+    }
+    if (res == 0)
+      break;
+    done += res;
+  }
+  return done;
+}
+
+/*
+ * Lines [first, first + count) into a malloc'ed buffer (*out, caller frees).
+ * Returns the number of bytes, 0 past the end, -1 on error.
+ */
+ssize_t my_lidx_read(my_line_index *li, size_t first, size_t count,
+                     char **out) {
+  size_t total = my_lidx_count(li);
+  *out = NULL;
+  if (first >= total || count == 0)
+    return 0;
+  if (count > total - first)
+    count = total - first;
+
+  const struct lidx_header *h = &li->hdr;
+  size_t last = first + count - 1;
+  uint64_t start = li->samples[first / h->stride];
+  uint64_t end = last / h->stride + 1 < h->nsamples
+                     ? li->samples[last / h->stride + 1]
+                     : h->file_sz;
+
+  char *buf = static_cast<char *>(malloc(end - start));
+  if (!buf && end > start)
+    return -1;
+  ssize_t n = lidx_pread(li, buf, end - start, start);
+  if (n < 0) {
+    free(buf);
+    return -1;
+  }
+
+  const char *p = buf, *stop = buf + n;
+  size_t skip = first % h->stride;
+  if (skip) {
+    p = my_find_nth_byte(p, stop, '\n', &skip);
+    p = p < stop ? p + 1 : stop;
+  }
+  size_t want = count;
+  const char *q = my_find_nth_byte(p, stop, '\n', &want);
+  q = q < stop ? q + 1 : stop;
+
+  size_t len = q - p;
+  memmove(buf, p, len);
+  *out = buf;
+  return len;
+}
+
+void my_lidx_close(my_line_index *li) {
+  if (!li)
+    return;
+  if (li->map)
+    munmap(li->map, li->map_sz);
+  if (li->s.ring_fd > 0)
+    app_teardown_uring(&li->s);
+  if (li->fd >= 0)
+    close(li->fd);
+  delete li;
+}
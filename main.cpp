@@ -1,14 +1,45 @@
 #include "my_io.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <ctime>
 #include <memory>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <omp.h>
+#include <condition_variable>
 #include <mutex>
+#include <thread>
+#include <vector>
 
 double perFileTime;
+bool verify; // -v: check each file against its "<file>.crc32c" sidecar
+bool pipeline; // -p: read through a pipeline with a CRC32C stage and report its counters
+bool scan;     // -d: as -p, with O_DIRECT and PIPE_SCAN_DEPTH reads in flight (raw devices)
+double latency = -1; // -l usec: adaptive pipeline depth for this latency target, 0 derives one
+bool idle;     // -i: pipeline reads at idle I/O priority, out of everyone else's way
+double rate;   // -r MB/s: limit each pipeline's reads to this bandwidth
 std::mutex io_mutex;  // Add a mutex to protect shared resources
 
+// All of len bytes to stdout. A pipe can take a blocking write short, for instance when io_uring
+// task work interrupts the writing thread, so the rest is written until done.
+static bool write_all(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            perror("write");
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
 void cat(const char *filename) {
     std::lock_guard<std::mutex> lock(io_mutex);  // Protect the entire file operation
 
@@ -23,7 +54,12 @@ void cat(const char *filename) {
     auto start = std::clock();
 
     while ((bytesRead = my_fread(buffer.get(), sizeof(char), sizeof(buffer), mf)) > 0) {
-        write(STDOUT_FILENO, buffer.get(), bytesRead);
+        if (!write_all(buffer.get(), bytesRead))
+            break;
+    }
+    if (my_ferror(mf)) {
+        errno = my_ferror(mf);
+        perror(filename);
     }
 
     //std::cout << std::endl;
@@ -35,18 +71,248 @@ void cat(const char *filename) {
     my_fclose(mf);
 }
 
+// Read one file with a pool of range workers, writing chunks as they arrive in order.
+void cat_parallel(const char *filename, int threads) {
+    my_range_reader *rr = my_ropen_ex(filename, threads, 0, verify ? MY_RANGE_CRC32C : 0);
+    if (!rr) {
+        perror("Failed to open file.");
+        return;
+    }
+
+    const char *data;
+    ssize_t bytesRead;
+    auto start = std::clock();
+
+    while ((bytesRead = my_rview(rr, &data)) > 0) {
+        if (!write_all(data, bytesRead))
+            break;
+    }
+
+    auto end = std::clock();
+    double cpu_time_used = double(end - start) / CLOCKS_PER_SEC;
+    perFileTime += cpu_time_used;
+
+    std::cout << "\nCompleted reading '" << filename << "': Duration = " << cpu_time_used << " seconds, File Size = " << my_rsize(rr) << " bytes.\n";
+
+    uint32_t crc;
+    if (verify && bytesRead == 0 && my_rcrc32c(rr, &crc) == 0) {
+        int ok = my_crc32c_check(filename, crc, my_rsize(rr));
+        std::cerr << filename << ": CRC32C " << (ok > 0 ? "OK" : ok == 0 ? "MISMATCH" : "no sidecar") << "\n";
+    }
+    my_rclose(rr);
+}
+
+// stdin ("-"), pipes, FIFOs and the like have no size to split or lay out up front.
+static bool is_stream(const char *filename) {
+    struct stat st;
+    return strcmp(filename, "-") == 0 ||
+           (stat(filename, &st) == 0 && !S_ISBLK(st.st_mode) &&
+            (!S_ISREG(st.st_mode) || st.st_size == 0));
+}
+
+// Block devices are read through the pipeline unless split with -j: my_fopen lays a file out in one
+// READV, which cannot cover a whole volume.
+static bool is_device(const char *filename) {
+    struct stat st;
+    return stat(filename, &st) == 0 && S_ISBLK(st.st_mode);
+}
+
+// A file on its way through a pipeline: source -> CRC32C stage on its own thread -> stdout.
+struct cat_job {
+    const char *name;
+    my_pipeline *pl;
+    uint32_t crc;
+};
+
+static bool cat_job_open(cat_job *job) {
+    unsigned flags = (scan ? MY_PIPE_DIRECT : 0) | (latency >= 0 ? MY_PIPE_ADAPTIVE : 0);
+    job->pl = my_pipe_open_ex(job->name, flags, scan ? PIPE_SCAN_DEPTH : PIPE_DEPTH);
+    job->crc = 0;
+    bool checksum = pipeline || verify;
+    if (!job->pl || (latency > 0 && my_pipe_set_latency(job->pl, latency / 1e6) < 0) ||
+        (idle && my_pipe_set_prio(job->pl, MY_PRIO_IDLE) < 0) ||
+        (rate > 0 && my_pipe_set_rate(job->pl, rate * 1024 * 1024, 0) < 0) ||
+        (checksum &&
+         my_pipe_add_stage(job->pl, "crc32c", my_stage_crc32c, &job->crc, MY_STAGE_THREAD, 4) < 0) ||
+        my_pipe_start(job->pl) < 0) {
+        my_pipe_close(job->pl);
+        job->pl = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Write the file out, then each stage's counters on stderr.
+static void cat_job_emit(cat_job *job) {
+    my_pipeline *pl = job->pl;
+    const char *data;
+    ssize_t bytesRead;
+    off_t total = 0;
+    while ((bytesRead = my_pipe_view(pl, &data)) > 0) {
+        if (!write_all(data, bytesRead))
+            break;
+        total += bytesRead;
+    }
+    if (bytesRead < 0)
+        perror(job->name);
+
+    for (int i = -1; pipeline && i < my_pipe_stages(pl); i++) {
+        my_stage_stats st;
+        my_pipe_stats(pl, i, &st);
+        std::cerr << job->name << ": " << my_pipe_stage_name(pl, i) << ": " << st.bufs << " buffers, "
+                  << st.bytes << " bytes, busy " << st.busy_sec << "s, blocked " << st.blocked_sec
+                  << "s, max queued " << st.max_queued << "\n";
+    }
+    my_qd qd;
+    if (pipeline && my_pipe_qd(pl, &qd) == 0 && qd.completions)
+        std::cerr << job->name << ": queue depth " << qd.limit << " (peak " << qd.peak_limit << " of "
+                  << qd.max_limit << ", +" << qd.increases << " -" << qd.decreases << "), latency mean "
+                  << qd.lat_sum / qd.completions * 1e6 << "us max " << qd.lat_max * 1e6
+                  << "us target " << my_qd_target(&qd) * 1e6 << "us\n";
+    my_throttle t;
+    if (pipeline && rate > 0 && my_pipe_throttle(pl, &t) == 0)
+        std::cerr << job->name << ": throttle " << t.bytes_per_sec / (1024 * 1024) << " MB/s: "
+                  << t.reads << " reads, " << t.read_bytes << " bytes, " << t.waits << " waits\n";
+    my_ring_stats ring;
+    if (pipeline && my_pipe_ring(pl, &ring) == 0 && ring.submitted)
+        std::cerr << job->name << ": ring: " << ring.submitted << " SQEs, " << ring.enters << " enters ("
+                  << (double)ring.enters / ring.submitted << " per I/O), " << ring.full << " full\n";
+    if (verify && bytesRead == 0) {
+        int ok = my_crc32c_check(job->name, job->crc, total);
+        std::cerr << job->name << ": CRC32C " << (ok > 0 ? "OK" : ok == 0 ? "MISMATCH" : "no sidecar") << "\n";
+    }
+    my_pipe_close(pl);
+    job->pl = NULL;
+}
+
+// Streams come this way too, written out as they arrive.
+void cat_pipeline(const char *filename) {
+    cat_job job = {filename, NULL, 0};
+    if (cat_job_open(&job))
+        cat_job_emit(&job);
+}
+
+/*
+ * -a N: an opener thread keeps files i+1 .. i+N open with their pipelines started while file i is
+ * written, so their first chunks are read by the time they come up. Each pipeline stops reading
+ * once its buffers are full, which bounds the look-ahead; output stays in argument order.
+ */
+void cat_lookahead(char **names, int n, int depth, int warm, bool drop) {
+    std::vector<cat_job> jobs(n);
+    std::mutex lock;
+    std::condition_variable cv;
+    int opened = 0, emitted = 0;
+
+    std::thread opener([&] {
+        int warmed = 0; // -w: hints run ahead of the opens
+        for (int k = 0; k < n; k++) {
+            for (; warmed < n && warmed <= k + warm; warmed++)
+                if (warmed > k && !is_stream(names[warmed]))
+                    my_prefetch(names[warmed], 0, 0);
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                cv.wait(guard, [&] { return k <= emitted + depth; });
+            }
+            jobs[k].name = names[k];
+            cat_job_open(&jobs[k]);
+            std::lock_guard<std::mutex> guard(lock);
+            opened++;
+            cv.notify_all();
+        }
+    });
+    for (int k = 0; k < n; k++) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            cv.wait(guard, [&] { return opened > k; });
+        }
+        if (jobs[k].pl)
+            cat_job_emit(&jobs[k]);
+        if (drop && !is_stream(names[k]))
+            my_drop_cache(names[k]);
+        std::lock_guard<std::mutex> guard(lock);
+        emitted++;
+        cv.notify_all();
+    }
+    opener.join();
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <filename>\n";
+    int threads = 0;
+    int warm = 0;      // -w K: keep the next K files prefetched
+    int ahead = 0;     // -a N: keep the next N files open and reading
+    bool drop = false; // -n: drop each file from the page cache once written
+    int first = 1;
+    for (;;) {
+        if (argc > first + 1 && strcmp(argv[first], "-j") == 0) {
+            threads = atoi(argv[first + 1]);
+            first += 2;
+        } else if (argc > first + 1 && strcmp(argv[first], "-a") == 0) {
+            ahead = atoi(argv[first + 1]);
+            first += 2;
+        } else if (argc > first + 1 && strcmp(argv[first], "-l") == 0) {
+            latency = atof(argv[first + 1]);
+            first += 2;
+        } else if (argc > first + 1 && strcmp(argv[first], "-r") == 0) {
+            rate = atof(argv[first + 1]);
+            first += 2;
+        } else if (argc > first + 1 && strcmp(argv[first], "-w") == 0) {
+            warm = atoi(argv[first + 1]);
+            first += 2;
+        } else if (argc > first && strcmp(argv[first], "-n") == 0) {
+            drop = true;
+            first++;
+        } else if (argc > first && strcmp(argv[first], "-i") == 0) {
+            idle = true;
+            first++;
+        } else if (argc > first && strcmp(argv[first], "-v") == 0) {
+            verify = true;
+            first++;
+        } else if (argc > first && strcmp(argv[first], "-p") == 0) {
+            pipeline = true;
+            first++;
+        } else if (argc > first && strcmp(argv[first], "-d") == 0) {
+            pipeline = scan = true;
+            first++;
+        } else {
+            break;
+        }
+    }
+    if (argc <= first || (verify && threads <= 0 && !pipeline && ahead <= 0) ||
+        ((pipeline || ahead > 0) && threads > 0) || warm < 0 || ahead < 0 || rate < 0 ||
+        ((latency >= 0 || idle || rate > 0) && !pipeline && ahead <= 0)) {
+        std::cerr << "Usage: " << argv[0] << " [-j threads | -p | -d | -a files] [-l usec] [-i]"
+                  << " [-r MB/s] [-v] [-w files] [-n] <filename>\n";
         return 1;
     }
 
     perFileTime = 0.0;
     auto start = std::clock();
 
-    for (int i = 1; i < argc; i++) {
-        cat(argv[i]);
+    if (ahead > 0) {
+        cat_lookahead(argv + first, argc - first, ahead, warm, drop);
+        my_prefetch_wait();
+        return 0;
+    }
+
+    int warmed = first; // Files before this one have been prefetched
+    for (int i = first; i < argc; i++) {
+        for (; warm > 0 && warmed < argc && warmed <= i + warm; warmed++)
+            if (warmed > i && !is_stream(argv[warmed]))
+                my_prefetch(argv[warmed], 0, 0);
+
+        if (pipeline || is_stream(argv[i]))
+            cat_pipeline(argv[i]);
+        else if (threads > 0)
+            cat_parallel(argv[i], threads);
+        else if (is_device(argv[i]))
+            cat_pipeline(argv[i]);
+        else
+            cat(argv[i]);
+
+        if (drop && !is_stream(argv[i]))
+            my_drop_cache(argv[i]);
     }
+    my_prefetch_wait();
 
     auto end = std::clock();
     double total_time = double(end - start) / CLOCKS_PER_SEC;
@@ -0,0 +1,349 @@
+#include "my_io.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#define CMP_CHUNK (128 * 1024)
+#define CMP_DEPTH 4                // Rounds of chunks in flight
+#define CMP_RING_MAX 4096          // Ring entries, and requests in flight, at most
+#define CMP_CANCEL (1ull << 63)    // Tags the user_data of cancel requests
+
+/*
+ * The reference (the first file) and every file compared against it are read
+ * through one ring in lockstep rounds: round k holds chunk k of the reference
+ * and of each file whose outcome is still open, and CMP_DEPTH rounds are in
+ * flight. A round is compared once all its reads are in, so the reference is
+ * read once however many files are checked against it. A file that differs
+ * gets its outstanding reads cancelled and is not read any further.
+ *
+ * With many files fewer rounds are in flight, down to one, so the ring stays
+ * within CMP_RING_MAX entries. Past that a round is issued as completions
+ * make room.
+ */
+struct cmp_file {
+    const char *name;
+    int fd;
+    off_t size;
+    bool done;
+    int result; // 0 same, 1 differs, 2 error
+    std::string out;
+    std::string err;
+};
+
+struct cmp_read {
+    char *buf;
+    unsigned len;
+    unsigned filled;
+    bool issued; // Part of its round
+    bool active; // Still in flight
+};
+
+struct cmp_state {
+    submitter s;
+    int nfiles;
+    std::vector<cmp_file> files;
+    std::vector<cmp_read> reads; // [slot * nfiles + file]
+    int depth; // Rounds in flight
+    int pending[CMP_DEPTH];
+    long long round[CMP_DEPTH];
+    int inflight;
+    int max_inflight; // Requests the ring's completion queue has room for
+    int live; // Files other than the reference still being compared
+    size_t lines; // Newlines in the reference before the current round
+    char last;    // and the byte just before it
+};
+
+static int cmp_prep_read(cmp_state *st, int idx) {
+    cmp_read *r = &st->reads[idx];
+    struct io_uring_sqe *sqe = app_get_sqe(&st->s);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = st->files[idx % st->nfiles].fd;
+    sqe->addr = (unsigned long)(r->buf + r->filled);
+    sqe->len = r->len - r->filled;
+    sqe->off = st->round[idx / st->nfiles] * CMP_CHUNK + r->filled;
+    sqe->user_data = idx;
+    return 0;
+}
+
+static bool cmp_needs_reads(cmp_state *st, int f) {
+    return f == 0 ? st->live > 0 : !st->files[f].done;
+}
+
+static int cmp_wait(cmp_state *st);
+
+static int cmp_issue_round(cmp_state *st, long long k) {
+    int slot = k % st->depth;
+    off_t off = k * CMP_CHUNK;
+    st->round[slot] = k;
+    for (int f = 0; f < st->nfiles; f++) {
+        cmp_read *r = &st->reads[slot * st->nfiles + f];
+        off_t size = st->files[f].size;
+        while (st->inflight >= st->max_inflight)
+            if (cmp_wait(st) < 0)
+                return -1;
+        r->issued = cmp_needs_reads(st, f) && off < size;
+        if (!r->issued)
+            continue;
+        r->len = size - off < CMP_CHUNK ? size - off : CMP_CHUNK;
+        r->filled = 0;
+        if (cmp_prep_read(st, slot * st->nfiles + f) < 0) {
+            perror("app_get_sqe");
+            return -1;
+        }
+        r->active = true;
+        st->pending[slot]++;
+        st->inflight++;
+    }
+    return 0;
+}
+
+// Stop reading file f: cancel whatever it still has in flight.
+static void cmp_cancel(cmp_state *st, int f) {
+    for (int slot = 0; slot < st->depth; slot++) {
+        int idx = slot * st->nfiles + f;
+        if (!st->reads[idx].active)
+            continue;
+        struct io_uring_sqe *sqe = app_get_sqe(&st->s);
+        if (!sqe)
+            return; // The reads run their course instead
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = idx;
+        sqe->user_data = CMP_CANCEL | idx;
+        st->inflight++;
+    }
+}
+
+static void cmp_finish(cmp_state *st, int f, int result) {
+    st->files[f].done = true;
+    st->files[f].result = result;
+    if (f > 0)
+        st->live--;
+    cmp_cancel(st, f);
+}
+
+static void cmp_complete(cmp_state *st, struct io_uring_cqe *cqe) {
+    unsigned long long ud = cqe->user_data;
+    int res = cqe->res;
+    st->inflight--;
+    if (ud & CMP_CANCEL)
+        return; // Done, or the read had already finished
+
+    int idx = (int)ud, f = idx % st->nfiles, slot = idx / st->nfiles;
+    cmp_read *r = &st->reads[idx];
+    if (res > 0 && r->filled + res < r->len && cmp_needs_reads(st, f)) {
+        r->filled += res; // Short read: ask for the rest
+        if (cmp_prep_read(st, idx) == 0) {
+            st->inflight++;
+            return;
+        }
+        res = -errno; // Fails the file like a read error
+    }
+    if (res < 0 && res != -ECANCELED && cmp_needs_reads(st, f)) {
+        errno = -res;
+        perror(st->files[f].name);
+        cmp_finish(st, f, 2);
+    } else if (res >= 0) {
+        r->filled += res;
+        if (res == 0)
+            r->len = r->filled; // The file shrank; treat this as its end.
+    }
+    r->active = false;
+    st->pending[slot]--;
+}
+
+static int cmp_wait(cmp_state *st) {
+    struct io_uring_cqe *cqe;
+    if (app_submit_and_wait(&st->s, 1) < 0 || app_wait_cqe(&st->s, &cqe) < 0)
+        return -1;
+    do {
+        cmp_complete(st, cqe);
+        app_cqe_seen(&st->s);
+    } while (app_peek_cqe(&st->s, &cqe) == 0);
+    return 0;
+}
+
+// cmp's wording for the file, name, that ends while the other goes on.
+static void cmp_eof(cmp_file *f, const char *name, off_t bytes, size_t newlines,
+                    bool ends_line) {
+    char msg[256];
+    if (bytes == 0)
+        snprintf(msg, sizeof(msg), "cmp: EOF on %s which is empty\n", name);
+    else if (ends_line)
+        snprintf(msg, sizeof(msg), "cmp: EOF on %s after byte %lld, line %zu\n", name,
+                 (long long)bytes, newlines);
+    else
+        snprintf(msg, sizeof(msg), "cmp: EOF on %s after byte %lld, in line %zu\n", name,
+                 (long long)bytes, newlines + 1);
+    f->err = msg;
+}
+
+static void cmp_round(cmp_state *st, long long k) {
+    int slot = k % st->depth;
+    off_t off = k * CMP_CHUNK;
+    cmp_read *ref = &st->reads[slot * st->nfiles];
+    size_t ref_len = ref->issued ? ref->len : 0;
+
+    for (int f = 1; f < st->nfiles; f++) {
+        cmp_file *cf = &st->files[f];
+        cmp_read *r = &st->reads[slot * st->nfiles + f];
+        if (cf->done)
+            continue;
+        size_t len = r->issued ? r->len : 0;
+        size_t n = ref_len < len ? ref_len : len;
+        size_t m = my_mismatch(ref->buf, r->buf, n);
+        if (m < n) {
+            char msg[256];
+            snprintf(msg, sizeof(msg), "%s %s differ: char %lld, line %zu\n", st->files[0].name,
+                     cf->name, (long long)(off + m + 1),
+                     st->lines + my_count_byte(ref->buf, ref->buf + m, '\n') + 1);
+            cf->out = msg;
+            cmp_finish(st, f, 1);
+        } else if (ref_len != len) {
+            size_t nl = st->lines + my_count_byte(ref->buf, ref->buf + n, '\n');
+            bool ends_line = (n > 0 ? ref->buf[n - 1] : st->last) == '\n';
+            cmp_eof(cf, len < ref_len ? cf->name : st->files[0].name, off + n, nl, ends_line);
+            cmp_finish(st, f, 1);
+        } else if (off + (off_t)len >= cf->size && off + (off_t)ref_len >= st->files[0].size) {
+            cmp_finish(st, f, 0);
+        }
+    }
+    if (st->live > 0 && ref_len > 0) {
+        st->lines += my_count_byte(ref->buf, ref->buf + ref_len, '\n');
+        st->last = ref->buf[ref_len - 1];
+    }
+}
+
+static bool cmp_open(cmp_file *cf) {
+    struct stat sb;
+    cf->done = false;
+    cf->result = 0;
+    cf->size = 0;
+    cf->fd = open(cf->name, O_RDONLY);
+    if (cf->fd < 0 || fstat(cf->fd, &sb) < 0) {
+        perror(cf->name);
+        return false;
+    }
+    if (!S_ISREG(sb.st_mode)) {
+        std::cerr << cf->name << ": not a regular file\n";
+        return false;
+    }
+    cf->size = sb.st_size;
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    bool quiet = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        switch (opt) {
+        case 's':
+            quiet = true;
+            break;
+        default:
+            std::cerr << "Usage: " << argv[0] << " [-s] <reference> <filename>...\n";
+            return 2;
+        }
+    }
+    if (argc - optind < 2) {
+        std::cerr << "Usage: " << argv[0] << " [-s] <reference> <filename>...\n";
+        return 2;
+    }
+
+    cmp_state st;
+    st.nfiles = argc - optind;
+    st.files.resize(st.nfiles);
+    st.inflight = 0;
+    st.live = st.nfiles - 1;
+    st.lines = 0;
+    st.last = 0;
+    for (int i = 0; i < CMP_DEPTH; i++)
+        st.pending[i] = 0;
+
+    int status = 0;
+    for (int f = 0; f < st.nfiles; f++) {
+        cmp_file *cf = &st.files[f];
+        cf->name = argv[optind + f];
+        if (cmp_open(cf))
+            continue;
+        if (f == 0)
+            return 2;
+        cf->done = true;
+        cf->result = 2;
+        st.live--;
+    }
+    // Only asked whether they differ: a size mismatch is enough.
+    for (int f = 1; quiet && f < st.nfiles; f++)
+        if (!st.files[f].done && st.files[f].size != st.files[0].size) {
+            st.files[f].done = true;
+            st.files[f].result = 1;
+            st.live--;
+        }
+
+    st.depth = CMP_RING_MAX / 2 / st.nfiles;
+    if (st.depth > CMP_DEPTH)
+        st.depth = CMP_DEPTH;
+    if (st.depth < 1)
+        st.depth = 1;
+    unsigned entries = 2 * st.depth * st.nfiles;
+    if (entries > CMP_RING_MAX)
+        entries = CMP_RING_MAX;
+    // The CQ ring is twice the SQ ring: reads up to entries, and as many
+    // cancels of them, always fit.
+    st.max_inflight = entries;
+    if (app_setup_uring_ex(&st.s, entries, 0))
+        return 2;
+    st.reads.resize(st.depth * st.nfiles);
+    for (size_t i = 0; i < st.reads.size(); i++) {
+        cmp_read *r = &st.reads[i];
+        r->issued = r->active = false;
+        if (posix_memalign((void **)&r->buf, BLOCK_SZ, CMP_CHUNK)) {
+            perror("posix_memalign");
+            return 2;
+        }
+    }
+
+    for (long long k = 0; k < st.depth; k++)
+        if (cmp_issue_round(&st, k) < 0)
+            return 2;
+    for (long long k = 0; st.live > 0; k++) {
+        int slot = k % st.depth;
+        while (st.pending[slot] > 0)
+            if (cmp_wait(&st) < 0)
+                return 2;
+        cmp_round(&st, k);
+        if (st.live > 0 && cmp_issue_round(&st, k + st.depth) < 0)
+            return 2;
+    }
+    // Everything is decided: drop the reference's read-ahead as well.
+    cmp_cancel(&st, 0);
+    while (st.inflight > 0)
+        if (cmp_wait(&st) < 0)
+            return 2;
+
+    for (int f = 1; f < st.nfiles; f++) {
+        cmp_file *cf = &st.files[f];
+        if (!quiet) {
+            std::cout << cf->out;
+            std::cerr << cf->err;
+        }
+        if (cf->result > status)
+            status = cf->result;
+    }
+    for (int f = 0; f < st.nfiles; f++)
+        if (st.files[f].fd >= 0)
+            close(st.files[f].fd);
+    for (size_t i = 0; i < st.reads.size(); i++)
+        free(st.reads[i].buf);
+    app_teardown_uring(&st.s);
+    return status;
+}
@@ -0,0 +1,71 @@
+#include "my_io.h"
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+static void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [-j threads] [-m auto|range|splice|buffered] <source> <dest>\n"
+              << "       " << prog << " -r [-j threads] [-q max_inflight] <source_dir> <dest_dir>\n";
+}
+
+int main(int argc, char *argv[]) {
+    int threads = 0;
+    int path = MY_COPY_AUTO;
+    int max_inflight = 0;
+    bool recursive = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:m:q:r")) != -1) {
+        switch (opt) {
+        case 'r':
+            recursive = true;
+            break;
+        case 'q':
+            max_inflight = atoi(optarg);
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'm':
+            if (strcmp(optarg, "range") == 0)
+                path = MY_COPY_RANGE;
+            else if (strcmp(optarg, "splice") == 0)
+                path = MY_COPY_SPLICE;
+            else if (strcmp(optarg, "buffered") == 0)
+                path = MY_COPY_BUFFERED;
+            else if (strcmp(optarg, "auto") != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    my_copy_stats st;
+    if (recursive) {
+        int ret = my_copy_tree(argv[optind], argv[optind + 1], threads, max_inflight, &st);
+        double mbps = st.seconds > 0 ? st.bytes_copied / st.seconds / (1024 * 1024) : 0;
+        std::cerr << "Copied " << st.files << " files in " << st.dirs << " directories from '" << argv[optind]
+                  << "' -> '" << argv[optind + 1] << "' via " << my_copy_path_name(st.path) << ": "
+                  << st.bytes_copied << " bytes in " << st.seconds << " seconds (" << mbps
+                  << " MB/s), user-space bytes = " << st.bytes_user << ".\n";
+        return ret < 0 ? 1 : 0;
+    }
+
+    if (my_copy_file(argv[optind], argv[optind + 1], path, threads, &st) < 0)
+        return 1;
+
+    double mbps = st.seconds > 0 ? st.bytes_copied / st.seconds / (1024 * 1024) : 0;
+    std::cerr << "Copied '" << argv[optind] << "' -> '" << argv[optind + 1] << "' via "
+              << my_copy_path_name(st.path) << ": " << st.bytes_copied << " bytes in " << st.seconds
+              << " seconds (" << mbps << " MB/s), user-space bytes = " << st.bytes_user << ".\n";
+    return 0;
+}
@@ -0,0 +1,243 @@
+#include "my_io.h"
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <omp.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// Files at least this big are split into ranges searched in parallel.
+#define GREP_SPLIT_SZ (8 * RANGE_CHUNK_SZ)
+
+struct grep_opts {
+    const char *pat;
+    size_t len;
+    bool line_numbers;
+    bool count_only;
+    bool show_names;
+};
+
+struct grep_hit {
+    size_t line; // Newlines in the range before the line starts
+    std::string text;
+};
+
+/*
+ * Per-range state. A range owns the lines that start in it: for every range
+ * but the first, the bytes before its first newline (lead) finish a line
+ * begun in an earlier range and are matched when the ranges are merged.
+ */
+struct grep_range {
+    const grep_opts *o;
+    bool in_lead;
+    std::string lead;
+    std::string carry; // Partial line at the end of the last chunk
+    size_t lines;
+    size_t matches;
+    std::vector<grep_hit> hits;
+};
+
+static void grep_hit_line(grep_range *r, size_t line, const char *p, size_t n) {
+    r->matches++;
+    if (!r->o->count_only) {
+        grep_hit hit = {line, std::string(p, n)};
+        r->hits.push_back(hit);
+    }
+}
+
+static bool grep_match(const grep_opts *o, const char *p, size_t n) {
+    return my_find_literal(p, p + n, o->pat, o->len) != p + n;
+}
+
+// Search whole lines in [p, end); end is just past a newline.
+static void grep_region(grep_range *r, const char *p, const char *end) {
+    const grep_opts *o = r->o;
+    const char *counted = p, *q = p;
+    const char *hit;
+
+    while ((hit = my_find_literal(q, end, o->pat, o->len)) != end) {
+        const char *ls = hit;
+        while (ls > q && ls[-1] != '\n')
+            ls--;
+        const char *le = my_find_byte(hit, end, '\n');
+        r->lines += my_count_byte(counted, ls, '\n');
+        counted = ls;
+        grep_hit_line(r, r->lines, ls, le - ls);
+        q = le + 1;
+    }
+    r->lines += my_count_byte(counted, end, '\n');
+}
+
+static int grep_chunk(const char *data, size_t len, off_t off, int range, void *arg) {
+    grep_range *r = static_cast<grep_range *>(arg) + range;
+    const char *p = data, *end = data + len;
+    (void)off;
+
+    if (r->in_lead || !r->carry.empty()) {
+        const char *nl = my_find_byte(p, end, '\n');
+        std::string &head = r->in_lead ? r->lead : r->carry;
+        head.append(p, nl - p);
+        if (nl == end)
+            return 0;
+        if (!r->in_lead && grep_match(r->o, head.data(), head.size()))
+            grep_hit_line(r, r->lines, head.data(), head.size());
+        if (!r->in_lead)
+            r->carry.clear();
+        r->in_lead = false;
+        r->lines++;
+        p = nl + 1;
+    }
+
+    const char *last = end;
+    while (last > p && last[-1] != '\n')
+        last--;
+    grep_region(r, p, last);
+    r->carry.assign(last, end);
+    return 0;
+}
+
+static void grep_emit(std::string &out, const grep_opts *o, const char *filename, size_t line,
+                      const std::string &text) {
+    if (o->show_names) {
+        out += filename;
+        out += ':';
+    }
+    if (o->line_numbers) {
+        out += std::to_string(line);
+        out += ':';
+    }
+    out += text;
+    out += '\n';
+}
+
+/*
+ * Search one file, leaving its output in out. Ranges are merged in order,
+ * matching the lines that straddle range boundaries on the way.
+ */
+static int grep_file(const char *filename, int threads, const grep_opts *o, std::string &out,
+                     size_t *matches) {
+    std::vector<grep_range> ranges(threads);
+    for (int i = 0; i < threads; i++) {
+        ranges[i].o = o;
+        ranges[i].in_lead = i > 0;
+        ranges[i].lines = 0;
+        ranges[i].matches = 0;
+    }
+    if (my_read_ranges(filename, threads, grep_chunk, ranges.data()) < 0)
+        return -1;
+
+    size_t base = 0, count = 0;
+    std::string pending;
+    for (int i = 0; i < threads; i++) {
+        grep_range *r = &ranges[i];
+        if (i > 0) {
+            pending += r->lead;
+            if (r->in_lead)
+                continue; // No newline in this range; the line goes on.
+            if (grep_match(o, pending.data(), pending.size())) {
+                count++;
+                if (!o->count_only)
+                    grep_emit(out, o, filename, base + 1, pending);
+            }
+        }
+        count += r->matches;
+        if (!o->count_only)
+            for (size_t h = 0; h < r->hits.size(); h++)
+                grep_emit(out, o, filename, base + r->hits[h].line + 1, r->hits[h].text);
+        base += r->lines;
+        pending = r->carry;
+    }
+    // A last line without '\n'.
+    if (!pending.empty() && grep_match(o, pending.data(), pending.size())) {
+        count++;
+        if (!o->count_only)
+            grep_emit(out, o, filename, base + 1, pending);
+    }
+
+    if (o->count_only) {
+        if (o->show_names) {
+            out += filename;
+            out += ':';
+        }
+        out += std::to_string(count);
+        out += '\n';
+    }
+    *matches += count;
+    return 0;
+}
+
+static bool grep_is_large(const char *filename) {
+    struct stat st;
+    return stat(filename, &st) == 0 && st.st_size >= GREP_SPLIT_SZ;
+}
+
+int main(int argc, char *argv[]) {
+    grep_opts o = {NULL, 0, false, false, false};
+    int threads = omp_get_max_threads();
+    int opt;
+
+    while ((opt = getopt(argc, argv, "cnj:")) != -1) {
+        switch (opt) {
+        case 'c':
+            o.count_only = true;
+            break;
+        case 'n':
+            o.line_numbers = true;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        default:
+            std::cerr << "Usage: " << argv[0] << " [-c] [-n] [-j threads] <pattern> <filename>...\n";
+            return 2;
+        }
+    }
+    if (argc - optind < 2 || threads < 1) {
+        std::cerr << "Usage: " << argv[0] << " [-c] [-n] [-j threads] <pattern> <filename>...\n";
+        return 2;
+    }
+    o.pat = argv[optind];
+    o.len = strlen(o.pat);
+    if (o.len == 0 || strchr(o.pat, '\n')) {
+        std::cerr << argv[0] << ": pattern must be a non-empty single-line literal\n";
+        return 2;
+    }
+    char **files = argv + optind + 1;
+    int nfiles = argc - optind - 1;
+    o.show_names = nfiles > 1;
+
+    size_t matches = 0;
+    bool failed = false;
+    for (int i = 0; i < nfiles;) {
+        if (grep_is_large(files[i])) {
+            // One big file: all threads on its ranges.
+            std::string out;
+            if (grep_file(files[i], threads, &o, out, &matches) < 0)
+                failed = true;
+            write(STDOUT_FILENO, out.data(), out.size());
+            i++;
+            continue;
+        }
+
+        // A run of smaller files: one file per thread, printed in order.
+        int j = i;
+        while (j < nfiles && !grep_is_large(files[j]))
+            j++;
+#pragma omp parallel for ordered schedule(dynamic, 1) num_threads(threads) reduction(+ : matches) \
+    reduction(|| : failed)
+        for (int k = i; k < j; k++) {
+            std::string out;
+            if (grep_file(files[k], 1, &o, out, &matches) < 0)
+                failed = true;
+#pragma omp ordered
+            write(STDOUT_FILENO, out.data(), out.size());
+        }
+        i = j;
+    }
+
+    if (failed)
+        return 2;
+    return matches ? 0 : 1;
+}
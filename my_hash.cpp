@@ -0,0 +1,223 @@
+#include "my_io.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <ftw.h>
+#include <iostream>
+#include <omp.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// Files at least this big are tree-hashed by every thread at once.
+#define HASH_SPLIT_SZ (8 * RANGE_CHUNK_SZ)
+
+struct hash_entry {
+    std::string name;
+    off_t size;
+    std::string digest;
+    bool ok;
+};
+
+static std::vector<hash_entry> entries;
+
+static int hash_collect(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)ftw;
+    if (type == FTW_F && S_ISREG(st->st_mode)) {
+        hash_entry e = {path, st->st_size, "", false};
+        entries.push_back(e);
+    }
+    return 0;
+}
+
+// Regular files are taken as they are; directories are walked recursively.
+static bool hash_add_arg(const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        perror(path);
+        return false;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        if (nftw(path, hash_collect, 64, FTW_PHYS) < 0) {
+            perror(path);
+            return false;
+        }
+        return true;
+    }
+    off_t size = st.st_size;
+    if (S_ISBLK(st.st_mode)) {
+        int fd = open(path, O_RDONLY);
+        size = fd < 0 ? -1 : get_file_size(fd);
+        if (fd >= 0)
+            close(fd);
+        if (size < 0) {
+            perror(path);
+            return false;
+        }
+    }
+    hash_entry e = {path, size, "", false};
+    entries.push_back(e);
+    return true;
+}
+
+enum { HASH_FAST, HASH_SHA256, HASH_CRC32C };
+
+static bool save_crc; // -w: write "<file>.crc32c" sidecars for my_cat -v
+
+static void hash_one(hash_entry *e, int threads, int kind) {
+    char hex[65];
+    if (kind == HASH_CRC32C) {
+        uint32_t crc = 0;
+        e->ok = my_crc32c_file(e->name.c_str(), threads, &crc) == 0;
+        if (e->ok && save_crc)
+            e->ok = my_crc32c_save(e->name.c_str(), crc, e->size) == 0;
+        snprintf(hex, sizeof(hex), "%08x", crc);
+    } else if (kind == HASH_SHA256) {
+        unsigned char d[32];
+        e->ok = my_sha256_file(e->name.c_str(), threads, d) == 0;
+        for (int i = 0; i < 32; i++)
+            snprintf(hex + 2 * i, 3, "%02x", d[i]);
+    } else {
+        uint64_t h = 0;
+        e->ok = my_hash_file(e->name.c_str(), threads, &h) == 0;
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)h);
+    }
+    e->digest = hex;
+}
+
+// Hash the given entries: small files one per thread, then big files with
+// every thread on their ranges.
+static void hash_all(const std::vector<hash_entry *> &todo, int threads, int kind) {
+    int n = todo.size();
+#pragma omp parallel for schedule(dynamic, 1) num_threads(threads)
+    for (int i = 0; i < n; i++)
+        if (todo[i]->size < HASH_SPLIT_SZ)
+            hash_one(todo[i], 1, kind);
+    for (int i = 0; i < n; i++)
+        if (todo[i]->size >= HASH_SPLIT_SZ)
+            hash_one(todo[i], threads, kind);
+}
+
+static bool by_size(const hash_entry *a, const hash_entry *b) {
+    return a->size != b->size ? a->size < b->size : a->name < b->name;
+}
+
+static bool by_digest(const hash_entry *a, const hash_entry *b) {
+    if (a->size != b->size)
+        return a->size < b->size;
+    return a->digest != b->digest ? a->digest < b->digest : a->name < b->name;
+}
+
+/*
+ * Only files that share their size with another file can be duplicates, so
+ * just those are hashed. Groups are printed one name per line, separated by
+ * blank lines.
+ */
+static bool hash_duplicates(int threads, int kind) {
+    std::vector<hash_entry *> all, todo;
+    for (size_t i = 0; i < entries.size(); i++)
+        if (entries[i].size > 0)
+            all.push_back(&entries[i]);
+    std::sort(all.begin(), all.end(), by_size);
+    for (size_t i = 0; i < all.size(); i++) {
+        bool prev = i > 0 && all[i - 1]->size == all[i]->size;
+        bool next = i + 1 < all.size() && all[i + 1]->size == all[i]->size;
+        if (prev || next)
+            todo.push_back(all[i]);
+    }
+    hash_all(todo, threads, kind);
+
+    std::vector<hash_entry *> done;
+    bool failed = false;
+    for (size_t i = 0; i < todo.size(); i++) {
+        if (todo[i]->ok)
+            done.push_back(todo[i]);
+        else
+            failed = true;
+    }
+    std::sort(done.begin(), done.end(), by_digest);
+
+    std::string out;
+    size_t groups = 0;
+    off_t wasted = 0;
+    for (size_t i = 0; i < done.size();) {
+        size_t j = i + 1;
+        while (j < done.size() && done[j]->size == done[i]->size &&
+               done[j]->digest == done[i]->digest)
+            j++;
+        if (j - i > 1) {
+            if (groups++)
+                out += '\n';
+            for (size_t k = i; k < j; k++) {
+                out += done[k]->name;
+                out += '\n';
+            }
+            wasted += (off_t)(j - i - 1) * done[i]->size;
+        }
+        i = j;
+    }
+    write(STDOUT_FILENO, out.data(), out.size());
+    std::cerr << entries.size() << " files, " << todo.size() << " hashed, " << groups
+              << " duplicate groups, " << wasted << " bytes in extra copies\n";
+    return !failed;
+}
+
+int main(int argc, char *argv[]) {
+    int threads = omp_get_max_threads();
+    int kind = HASH_FAST;
+    bool dups = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "scwdj:")) != -1) {
+        switch (opt) {
+        case 's':
+            kind = HASH_SHA256;
+            break;
+        case 'c':
+            kind = HASH_CRC32C;
+            break;
+        case 'w':
+            save_crc = true;
+            break;
+        case 'd':
+            dups = true;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        default:
+            std::cerr << "Usage: " << argv[0] << " [-s | -c [-w]] [-d] [-j threads] <file|dir>...\n";
+            return 1;
+        }
+    }
+    if (optind >= argc || threads < 1 || (save_crc && kind != HASH_CRC32C)) {
+        std::cerr << "Usage: " << argv[0] << " [-s | -c [-w]] [-d] [-j threads] <file|dir>...\n";
+        return 1;
+    }
+
+    bool failed = false;
+    for (int i = optind; i < argc; i++)
+        if (!hash_add_arg(argv[i]))
+            failed = true;
+
+    if (dups)
+        return hash_duplicates(threads, kind) && !failed ? 0 : 1;
+
+    std::vector<hash_entry *> todo;
+    for (size_t i = 0; i < entries.size(); i++)
+        todo.push_back(&entries[i]);
+    hash_all(todo, threads, kind);
+
+    std::string out;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (!entries[i].ok) {
+            failed = true;
+            continue;
+        }
+        out += entries[i].digest + "  " + entries[i].name + "\n";
+    }
+    write(STDOUT_FILENO, out.data(), out.size());
+    return failed ? 1 : 0;
+}
@@ -2,11 +2,23 @@
 #define M_IO_H
 
 #include <atomic>
+#include <cstdint>
 #include <cstdio> // For FILE and off_t
 #include <linux/io_uring.h>
+#include <sys/types.h>
 
 #define QUEUE_DEPTH 256
 #define BLOCK_SZ 4096
+#define RANGE_CHUNK_SZ (1024 * 1024) // Parallel range reader chunk size
+#define RANGE_DEPTH 8                // Chunks in flight per range worker
+#define LIDX_STRIDE 1024             // Lines per line-index sample
+#define MY_RANGE_CRC32C 1            // my_ropen_ex(): checksum every chunk
+#define PIPE_BUF_SZ (256 * 1024)     // Read pipeline buffer size
+#define PIPE_DEPTH 8                 // Reads in flight per read pipeline
+#define PIPE_SCAN_DEPTH 64           // and for device scans
+#define MY_PIPE_DIRECT 1             // my_pipe_open_ex(): O_DIRECT, sector-aligned
+#define MY_PIPE_ADAPTIVE 2           // and: depth follows completion latency (my_qd)
+#define BATCH_DEPTH 32               // Reads in flight per batch of files
 
 inline void read_barrier() {
     std::atomic_thread_fence(std::memory_order_acquire);
@@ -37,11 +49,27 @@ struct app_io_cq_ring {
     struct io_uring_cqe *cqes;
 };
 
+// Submission counters of a ring: enters / submitted is what a request costs
+// in system calls.
+struct my_ring_stats {
+    size_t submitted; // SQEs handed to the kernel
+    size_t enters;    // io_uring_enter() calls
+    size_t full;      // Times app_get_sqe() found the SQ ring full
+};
+
 struct submitter {
     int ring_fd;
     app_io_sq_ring sq_ring;
     struct io_uring_sqe *sqes;
     app_io_cq_ring cq_ring;
+    unsigned setup_flags; // IORING_SETUP_* the ring was created with
+    unsigned sq_tail;     // Local tail, published by app_submit()
+    void *sq_ptr;
+    size_t sq_sz;
+    void *cq_ptr;
+    size_t cq_sz;
+    size_t sqes_sz;
+    my_ring_stats stats;
 };
 
 struct iovc {
@@ -63,20 +91,301 @@ struct my_file {
     submitter *s;
     file_info *fi_read;
     file_info *fi;
+    char *line_buf; // my_getline() stitch buffer for lines across blocks
+    size_t line_cap;
+    void *map;      // mmap engine: the whole file, which the blocks point into
+    size_t map_sz;
+    struct my_readahead *ra; // MY_FOPEN_PREAD engine: streams and read-ahead buffers
+    unsigned short ioprio;   // Of every read issued for the file
+    // MY_FOPEN_PREAD engine: my_fread() reads at current_offset through this, as device code
+    // cannot call into the host library
+    ssize_t (*pread)(struct my_file *mf, void *buf, size_t len, off_t off);
+    int err; // errno of a failed or timed out READV; my_fread() then returns 0 (my_ferror())
+};
+
+// my_fopen_ex() engine and access pattern. Without MY_FOPEN_MMAP the ring
+// engine reads the file into blocks; the pattern hints tune the mapping.
+#define MY_FOPEN_MMAP 0x1
+#define MY_FOPEN_RANDOM 0x2    // MADV_RANDOM instead of MADV_SEQUENTIAL
+#define MY_FOPEN_HOT 0x4       // MADV_WILLNEED: fault it all in up front
+#define MY_FOPEN_HUGEPAGE 0x8  // MADV_HUGEPAGE
+#define MY_FOPEN_PREAD 0x10    // Read nothing up front; my_pread() with adaptive read-ahead
+#define MY_FOPEN_PRIO_RT 0x20  // I/O priority class of the file's reads (sqe->ioprio)
+#define MY_FOPEN_PRIO_BE 0x40
+#define MY_FOPEN_PRIO_IDLE 0x80
+
+// user_data of the timeout linked to a read in a my_file's ring
+// (my_fopen_timed()); the read it bounds fails with ETIMEDOUT.
+#define MY_TIMEOUT_DATA (~0ull)
+
+// I/O priority classes, numbered as IOPRIO_CLASS_*. MY_PRIO_NONE leaves
+// the kernel's default.
+enum { MY_PRIO_NONE, MY_PRIO_RT, MY_PRIO_BE, MY_PRIO_IDLE };
+
+// Access pattern of the stream a my_pread() matched.
+enum { MY_RA_NONE, MY_RA_SEQUENTIAL, MY_RA_STRIDED, MY_RA_RANDOM };
+
+struct my_readahead_stats {
+    size_t reads;
+    size_t bytes;
+    size_t hits;         // Reads served entirely from read-ahead
+    size_t misses;       // Reads that needed a read of their own
+    size_t pattern_hits; // Reads that continued a sequential or strided stream
+    size_t ra_reads;     // Read-ahead issued
+    size_t ra_bytes;
+    size_t wasted_bytes; // Read ahead and evicted unread
+    int pattern;         // Of the stream the last read matched
+    unsigned depth;      // Its read-ahead depth
+    size_t chunk;        // and chunk size
+    my_ring_stats ring;  // Of the file's ring
+};
+
+// Copy paths, cheapest first. MY_COPY_AUTO picks one from the file types.
+enum {
+    MY_COPY_AUTO = 0,
+    MY_COPY_RANGE,   // copy_file_range(2), reflinks where the fs supports it
+    MY_COPY_SPLICE,  // file -> pipe -> file with IORING_OP_SPLICE
+    MY_COPY_BUFFERED // IORING_OP_READ/WRITE through user buffers
+};
+
+struct my_copy_stats {
+    int path;           // Slowest path any range had to fall back to
+    size_t bytes_copied;
+    size_t bytes_user;  // Bytes that went through user-space buffers
+    size_t files;       // Tree copies only
+    size_t dirs;
+    double seconds;
+};
+
+// Called on a worker thread for each chunk of its range, in file order.
+// Returning non-zero stops that worker.
+typedef int (*my_range_fn)(const char *data, size_t len, off_t off, int range, void *arg);
+
+struct my_range_reader;
+
+struct my_line_index;
+
+struct my_readahead;
+
+struct my_sha256 {
+    uint32_t h[8];
+    uint64_t len;
+    unsigned char buf[64];
+    size_t nbuf;
+};
+
+// A read pipeline buffer. Whoever holds the pointer owns it: a stage either
+// passes it on with my_stage_push() or hands it back with my_stage_release().
+struct my_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+    off_t off; // Offset of the data in the file, as read by the source
+};
+
+struct my_pipeline;
+struct my_stage;
+
+// Called for each buffer in stream order, then once with NULL at the end.
+// Returning non-zero fails the pipeline.
+typedef int (*my_stage_fn)(my_stage *st, my_buf *buf, void *arg);
+
+enum { MY_STAGE_INLINE, MY_STAGE_THREAD };
+
+struct my_stage_stats {
+    size_t bufs;
+    size_t bytes;
+    double busy_sec;    // In the stage function, less its waits and inline stages it fed
+    double blocked_sec; // Waiting on a full queue downstream or for a free buffer
+    size_t max_queued;  // Deepest its input queue got (threaded stages)
+};
+
+// Adaptive queue depth. The controller's state doubles as its metrics.
+struct my_qd {
+    unsigned limit;      // Requests allowed in flight now
+    unsigned max_limit;
+    unsigned peak_limit;
+    double target_sec;   // Latency target, 0 to derive one from base_sec
+    double base_sec;     // Fastest completion seen
+    bool slow_start;
+    double round_start;  // The round of completions being measured
+    size_t round_n;
+    size_t round_bytes;
+    double round_lat;
+    double last_tput;    // Bytes per second over the last round
+    size_t completions;
+    double lat_sum;
+    double lat_max;
+    unsigned increases;
+    unsigned decreases;
+};
+
+// Token-bucket limit on bytes and I/Os per second. Its state doubles as its
+// metrics. A my_file's bucket may be shared by other files read on the same
+// thread, which are then limited as one.
+struct my_throttle {
+    double bytes_per_sec; // 0 for no limit
+    double iops;
+    double bytes;         // Tokens in the buckets, negative in debt
+    double ios;
+    double last;          // When they were last refilled
+    size_t reads;         // Let through
+    size_t read_bytes;
+    size_t waits;         // Times a read was told to wait
+};
+
+// Which file of a batch issues the next read.
+enum { MY_SCHED_FIFO, MY_SCHED_SJF, MY_SCHED_DEADLINE, MY_SCHED_WRR };
+
+struct my_batch;
+
+// Called as each file of a batch is read whole; len is -errno on failure.
+// Returning non-zero stops the batch.
+typedef int (*my_batch_fn)(int file, const char *data, ssize_t len, void *arg);
+
+struct my_sched_stats {
+    size_t files;     // Read whole
+    size_t failed;
+    size_t bytes;
+    size_t missed;    // Done after their deadline
+    double mean_sec;  // Completion times, from the start of the batch
+    double p95_sec;
+    double max_sec;
+    double total_sec;
+    double prio_mean_sec[MY_PRIO_IDLE + 1]; // Mean completion time by priority class
+    my_ring_stats ring;
 };
 
+// How my_lidx_open() got its index.
+enum { MY_LIDX_MAPPED = 1, MY_LIDX_UPDATED, MY_LIDX_BUILT };
+
 // Global value
 extern int systemTimes;
 
 int io_uring_setup(unsigned entries, io_uring_params *p);
 int io_uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags);
 int io_uring_register(unsigned int fd, unsigned int opcode, const void *arg, unsigned int nr_args);
-off_t get_file_size(FILE *file);
+off_t get_file_size(int fd);
+int my_sector_sizes(int fd, unsigned *logical, unsigned *physical);
+unsigned short my_ioprio(int prio);
 void update_file_size(my_file *mf);
 int app_setup_uring(submitter *s);
+int app_setup_uring_ex(submitter *s, unsigned entries, unsigned flags);
+void app_teardown_uring(submitter *s);
+struct io_uring_sqe *app_get_sqe(submitter *s);
+int app_submit(submitter *s);
+int app_submit_and_wait(submitter *s, unsigned wait_nr);
+int app_peek_cqe(submitter *s, struct io_uring_cqe **cqe);
+int app_wait_cqe(submitter *s, struct io_uring_cqe **cqe);
+void app_cqe_seen(submitter *s);
+int app_prep_timeout(submitter *s, struct __kernel_timespec *ts, double sec,
+                     unsigned long long user_data);
+int app_link_timeout(submitter *s, struct io_uring_sqe *sqe, struct __kernel_timespec *ts,
+                     double sec, unsigned long long user_data);
+int app_cancel(submitter *s, unsigned long long target, bool all, unsigned long long user_data);
 my_file *my_fopen(const char *filename, const char *mode);
+my_file *my_fopen_ex(const char *filename, const char *mode, int flags);
+my_file *my_fopen_timed(const char *filename, const char *mode, int flags, double timeout_sec);
+bool my_gz_detect(int fd);
+file_info *my_gz_inflate(submitter *s, int fd, off_t file_sz, int *blocks);
+file_info *my_blocks_info(submitter *s, void **blocks, int n, size_t last_fill);
 bool submitRequest();
 size_t my_fread(void *ptr, size_t size, size_t count, my_file *mf);
 void my_fclose(my_file *mf);
+ssize_t my_getline(const char **line, my_file *mf);
+ssize_t my_fview(const char **data, my_file *mf);
+int my_fready(my_file *mf);
+int my_ferror(my_file *mf);
+ssize_t my_pread(my_file *mf, void *buf, size_t len, off_t off);
+int my_ra_stats(my_file *mf, my_readahead_stats *st);
+int my_fthrottle(my_file *mf, my_throttle *t);
+my_readahead *my_ra_open(off_t file_sz, double timeout_sec);
+void my_ra_close(my_file *mf);
+char *my_fgets(char *str, int size, my_file *mf);
+const char *my_find_byte(const char *p, const char *end, char c);
+size_t my_count_byte(const char *p, const char *end, char c);
+const char *my_find_nth_byte(const char *p, const char *end, char c, size_t *n);
+const char *my_find_literal(const char *p, const char *end, const char *pat, size_t len);
+void my_count_lines_words(const char *p, const char *end, bool *in_word, size_t *lines, size_t *words);
+const char *my_find_space(const char *p, const char *end);
+const char *my_skip_space(const char *p, const char *end);
+size_t my_mismatch(const char *a, const char *b, size_t n);
+uint64_t my_hash64(const void *data, size_t len, uint64_t seed);
+uint32_t my_crc32c(uint32_t crc, const void *data, size_t len);
+
+const char *my_copy_path_name(int path);
+int my_copy_fd(int in_fd, int out_fd, off_t len, int path, int threads, my_copy_stats *st);
+int my_copy_file(const char *src, const char *dst, int path, int threads, my_copy_stats *st);
+int my_copy_tree(const char *src, const char *dst, int threads, int max_inflight, my_copy_stats *st);
+
+int my_read_ranges(const char *filename, int threads, my_range_fn fn, void *arg);
+my_range_reader *my_ropen(const char *filename, int threads);
+my_range_reader *my_ropen_at(const char *filename, int threads, off_t start);
+my_range_reader *my_ropen_ex(const char *filename, int threads, off_t start, unsigned flags);
+ssize_t my_rview(my_range_reader *rr, const char **data);
+size_t my_rread(void *ptr, size_t size, size_t count, my_range_reader *rr);
+off_t my_rsize(my_range_reader *rr);
+int my_rcrc32c(my_range_reader *rr, uint32_t *crc);
+void my_rclose(my_range_reader *rr);
+
+my_line_index *my_lidx_open(const char *filename, unsigned stride);
+int my_lidx_state(my_line_index *li);
+size_t my_lidx_count(my_line_index *li);
+ssize_t my_lidx_read(my_line_index *li, size_t first, size_t count, char **out);
+void my_lidx_close(my_line_index *li);
+
+void my_sha256_init(my_sha256 *c);
+void my_sha256_update(my_sha256 *c, const void *data, size_t len);
+void my_sha256_final(my_sha256 *c, unsigned char out[32]);
+int my_hash_file(const char *filename, int threads, uint64_t *hash);
+int my_sha256_file(const char *filename, int threads, unsigned char out[32]);
+uint32_t my_crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+int my_crc32c_file(const char *filename, int threads, uint32_t *crc);
+int my_crc32c_save(const char *filename, uint32_t crc, off_t size);
+int my_crc32c_check(const char *filename, uint32_t crc, off_t size);
+
+int my_prefetch(const char *path, off_t off, off_t len);
+int my_prefetch_file(my_file *mf, off_t off, off_t len);
+int my_drop_cache(const char *path);
+void my_prefetch_wait();
+
+void my_qd_init(my_qd *qd, unsigned max_limit, double target_sec);
+double my_qd_target(const my_qd *qd);
+void my_qd_complete(my_qd *qd, double lat_sec, size_t bytes, double now);
+
+void my_throttle_init(my_throttle *t, double bytes_per_sec, double iops);
+void my_throttle_set(my_throttle *t, double bytes_per_sec, double iops);
+double my_throttle_take(my_throttle *t, size_t bytes, double now);
+
+const char *my_sched_name(int policy);
+my_batch *my_batch_open(int policy, unsigned depth);
+int my_batch_add(my_batch *b, const char *filename, double deadline_sec);
+int my_batch_prio(my_batch *b, int file, int prio);
+int my_batch_run(my_batch *b, my_batch_fn fn, void *arg);
+int my_batch_stats(my_batch *b, my_sched_stats *st);
+void my_batch_close(my_batch *b);
+
+my_pipeline *my_pipe_open(const char *filename);
+my_pipeline *my_pipe_open_ex(const char *filename, unsigned flags, unsigned depth);
+my_pipeline *my_pipe_fdopen(int fd);
+int my_pipe_add_stage(my_pipeline *pl, const char *name, my_stage_fn fn, void *arg, int mode,
+                      unsigned queue_len);
+int my_pipe_set_latency(my_pipeline *pl, double target_sec);
+int my_pipe_set_prio(my_pipeline *pl, int prio);
+int my_pipe_set_rate(my_pipeline *pl, double bytes_per_sec, double iops);
+int my_pipe_set_timeout(my_pipeline *pl, double timeout_sec);
+int my_pipe_start(my_pipeline *pl);
+ssize_t my_pipe_view(my_pipeline *pl, const char **data);
+int my_pipe_stages(my_pipeline *pl);
+const char *my_pipe_stage_name(my_pipeline *pl, int i);
+int my_pipe_stats(my_pipeline *pl, int i, my_stage_stats *st);
+int my_pipe_qd(my_pipeline *pl, my_qd *qd);
+int my_pipe_throttle(my_pipeline *pl, my_throttle *t);
+int my_pipe_ring(my_pipeline *pl, my_ring_stats *st);
+void my_pipe_close(my_pipeline *pl);
+int my_stage_push(my_stage *st, my_buf *buf);
+my_buf *my_stage_buf(my_stage *st);
+void my_stage_release(my_stage *st, my_buf *buf);
+int my_stage_crc32c(my_stage *st, my_buf *buf, void *arg);
 
 #endif // M_IO_H
@@ -0,0 +1,36 @@
+#include "my_io.h"
+#include <cstdlib>
+#include <iostream>
+#include <unistd.h>
+
+// Print lines [first, first + count) of a file through its sidecar line index.
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <filename> <first_line> [count]\n";
+        return 1;
+    }
+
+    size_t first = strtoull(argv[2], NULL, 10);
+    size_t count = argc > 3 ? strtoull(argv[3], NULL, 10) : 1;
+
+    my_line_index *li = my_lidx_open(argv[1], 0);
+    if (!li)
+        return 1;
+
+    static const char *states[] = {"", "mapped", "updated", "built"};
+    std::cerr << "Index for '" << argv[1] << "' " << states[my_lidx_state(li)] << ", " << my_lidx_count(li)
+              << " lines.\n";
+
+    char *lines;
+    ssize_t n = my_lidx_read(li, first, count, &lines);
+    if (n < 0) {
+        perror("my_lidx_read");
+        my_lidx_close(li);
+        return 1;
+    }
+    if (n > 0)
+        write(STDOUT_FILENO, lines, n);
+    free(lines);
+    my_lidx_close(li);
+    return 0;
+}
@@ -0,0 +1,170 @@
+#include "my_io.h"
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <omp.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// Files at least this big are split into ranges counted in parallel.
+#define WC_SPLIT_SZ (8 * RANGE_CHUNK_SZ)
+
+struct wc_counts {
+    size_t lines;
+    size_t words;
+    size_t bytes;
+};
+
+enum { WC_NO_EVENT, WC_SPACE, WC_WORD };
+
+/*
+ * Per-range partial counts. Each range starts as if preceded by a space; a
+ * word that straddles two ranges is counted twice and taken back on merge.
+ * Bytes that are neither spaces nor printable do not move the word state, so
+ * the merge looks at the first byte of each range that does.
+ */
+struct wc_range {
+    wc_counts c;
+    bool in_word;
+    int first_event;
+};
+
+static int wc_chunk(const char *data, size_t len, off_t off, int range, void *arg) {
+    wc_range *r = static_cast<wc_range *>(arg) + range;
+    (void)off;
+    if (len == 0)
+        return 0;
+    for (size_t i = 0; r->first_event == WC_NO_EVENT && i < len; i++) {
+        unsigned char ch = data[i];
+        if (ch == ' ' || (ch >= '\t' && ch <= '\r'))
+            r->first_event = WC_SPACE;
+        else if (ch > ' ' && ch < 0x7f)
+            r->first_event = WC_WORD;
+    }
+    my_count_lines_words(data, data + len, &r->in_word, &r->c.lines, &r->c.words);
+    r->c.bytes += len;
+    return 0;
+}
+
+static int wc_file(const char *filename, int threads, wc_counts *c) {
+    std::vector<wc_range> ranges(threads);
+    for (int i = 0; i < threads; i++) {
+        wc_counts zero = {0, 0, 0};
+        ranges[i].c = zero;
+        ranges[i].in_word = false;
+        ranges[i].first_event = WC_NO_EVENT;
+    }
+    if (my_read_ranges(filename, threads, wc_chunk, ranges.data()) < 0)
+        return -1;
+
+    wc_counts total = {0, 0, 0};
+    bool in_word = false;
+    for (int i = 0; i < threads; i++) {
+        wc_range *r = &ranges[i];
+        if (r->c.bytes == 0)
+            continue;
+        total.lines += r->c.lines;
+        total.words += r->c.words;
+        total.bytes += r->c.bytes;
+        if (r->first_event == WC_NO_EVENT)
+            continue; // Nothing here changes the word state.
+        if (in_word && r->first_event == WC_WORD)
+            total.words--;
+        in_word = r->in_word;
+    }
+    *c = total;
+    return 0;
+}
+
+static bool wc_is_large(const char *filename, off_t *size) {
+    struct stat st;
+    if (stat(filename, &st) < 0)
+        return false;
+    *size += st.st_size;
+    return st.st_size >= WC_SPLIT_SZ;
+}
+
+static void wc_print(const wc_counts &c, bool l, bool w, bool b, int width, const char *name) {
+    char line[128];
+    int n = 0;
+    if (l)
+        n += snprintf(line + n, sizeof(line) - n, "%*zu", width, c.lines);
+    if (w)
+        n += snprintf(line + n, sizeof(line) - n, "%s%*zu", n ? " " : "", width, c.words);
+    if (b)
+        n += snprintf(line + n, sizeof(line) - n, "%s%*zu", n ? " " : "", width, c.bytes);
+    std::cout << line << " " << name << "\n";
+}
+
+int main(int argc, char *argv[]) {
+    bool l = false, w = false, b = false;
+    int threads = omp_get_max_threads();
+    int opt;
+
+    while ((opt = getopt(argc, argv, "lwcj:")) != -1) {
+        switch (opt) {
+        case 'l':
+            l = true;
+            break;
+        case 'w':
+            w = true;
+            break;
+        case 'c':
+            b = true;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        default:
+            std::cerr << "Usage: " << argv[0] << " [-l] [-w] [-c] [-j threads] <filename>...\n";
+            return 1;
+        }
+    }
+    if (optind >= argc || threads < 1) {
+        std::cerr << "Usage: " << argv[0] << " [-l] [-w] [-c] [-j threads] <filename>...\n";
+        return 1;
+    }
+    if (!l && !w && !b)
+        l = w = b = true;
+
+    char **files = argv + optind;
+    int nfiles = argc - optind;
+    std::vector<wc_counts> counts(nfiles);
+    std::vector<char> large(nfiles);
+    std::vector<char> ok(nfiles);
+    off_t total_size = 0;
+    for (int i = 0; i < nfiles; i++)
+        large[i] = wc_is_large(files[i], &total_size);
+
+    // Small files one per thread, then big files with every thread on their ranges.
+#pragma omp parallel for schedule(dynamic, 1) num_threads(threads)
+    for (int i = 0; i < nfiles; i++)
+        if (!large[i])
+            ok[i] = wc_file(files[i], 1, &counts[i]) == 0;
+    for (int i = 0; i < nfiles; i++)
+        if (large[i])
+            ok[i] = wc_file(files[i], threads, &counts[i]) == 0;
+
+    // Same column width rule as coreutils wc for regular files.
+    int width = 1;
+    if ((l + w + b) > 1 || nfiles > 1)
+        width = (int)std::to_string((long long)total_size).size();
+
+    wc_counts total = {0, 0, 0};
+    bool failed = false;
+    for (int i = 0; i < nfiles; i++) {
+        if (!ok[i]) {
+            failed = true;
+            continue;
+        }
+        wc_print(counts[i], l, w, b, width, files[i]);
+        total.lines += counts[i].lines;
+        total.words += counts[i].words;
+        total.bytes += counts[i].bytes;
+    }
+    if (nfiles > 1)
+        wc_print(total, l, w, b, width, "total");
+    return failed ? 1 : 0;
+}
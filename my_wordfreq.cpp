@@ -0,0 +1,273 @@
+#include "my_io.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <omp.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Keys are copied into arena blocks of this size (longer keys get their own).
+#define WF_ARENA_SZ (1024 * 1024)
+#define WF_MIN_SLOTS 4096
+
+/*
+ * A word is a run of bytes between whitespace. Every range counts its words
+ * into its own open-addressing table (linear probing, power-of-two size) so
+ * the tokenizers never share a cache line; the tables are merged at the end.
+ */
+struct wf_entry {
+    uint64_t hash;
+    const char *key; // NULL for an empty slot
+    uint32_t len;
+    uint64_t count;
+};
+
+struct wf_table {
+    std::vector<wf_entry> slots;
+    size_t used;
+    std::vector<char *> blocks;
+    char *next; // Free space in the last block
+    char *limit;
+};
+
+struct wf_range {
+    wf_table *t;
+    bool in_lead;
+    std::string lead;  // Bytes before the first space, for ranges after the first
+    std::string carry; // Word cut off at the end of the last chunk
+};
+
+static uint64_t wf_hash(const char *p, size_t len) {
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ len;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        h = (h ^ v) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    uint64_t v = 0;
+    memcpy(&v, p, len);
+    h = (h ^ v) * 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 29);
+}
+
+static void wf_init(wf_table *t) {
+    wf_entry empty = {0, NULL, 0, 0};
+    t->slots.assign(WF_MIN_SLOTS, empty);
+    t->used = 0;
+    t->next = t->limit = NULL;
+}
+
+static void wf_free(wf_table *t) {
+    for (size_t i = 0; i < t->blocks.size(); i++)
+        free(t->blocks[i]);
+    t->blocks.clear();
+}
+
+static const char *wf_store(wf_table *t, const char *p, size_t len) {
+    if (len > (size_t)(t->limit - t->next)) {
+        size_t sz = len > WF_ARENA_SZ ? len : WF_ARENA_SZ;
+        char *b = static_cast<char *>(malloc(sz));
+        if (!b) {
+            perror("malloc");
+            exit(1);
+        }
+        t->blocks.push_back(b);
+        t->next = b;
+        t->limit = b + sz;
+    }
+    char *key = t->next;
+    memcpy(key, p, len);
+    t->next += len;
+    return key;
+}
+
+static void wf_grow(wf_table *t) {
+    std::vector<wf_entry> old;
+    wf_entry empty = {0, NULL, 0, 0};
+    old.swap(t->slots);
+    t->slots.assign(old.size() * 2, empty);
+    size_t mask = t->slots.size() - 1;
+    for (size_t i = 0; i < old.size(); i++) {
+        if (!old[i].key)
+            continue;
+        size_t j = old[i].hash & mask;
+        while (t->slots[j].key)
+            j = (j + 1) & mask;
+        t->slots[j] = old[i];
+    }
+}
+
+/*
+ * Add n to the count of key p[0..len). With shared_key the key already lives
+ * in another table's arena and is shared instead of copied.
+ */
+static void wf_add(wf_table *t, const char *p, size_t len, uint64_t h, uint64_t n,
+                   bool shared_key) {
+    if ((t->used + 1) * 10 > t->slots.size() * 7)
+        wf_grow(t);
+    size_t mask = t->slots.size() - 1;
+    for (size_t j = h & mask;; j = (j + 1) & mask) {
+        wf_entry *e = &t->slots[j];
+        if (!e->key) {
+            e->hash = h;
+            e->key = shared_key ? p : wf_store(t, p, len);
+            e->len = len;
+            e->count = n;
+            t->used++;
+            return;
+        }
+        if (e->hash == h && e->len == len && memcmp(e->key, p, len) == 0) {
+            e->count += n;
+            return;
+        }
+    }
+}
+
+static void wf_word(wf_table *t, const char *p, size_t len) {
+    wf_add(t, p, len, wf_hash(p, len), 1, false);
+}
+
+static int wf_chunk(const char *data, size_t len, off_t off, int range, void *arg) {
+    wf_range *r = static_cast<wf_range *>(arg) + range;
+    const char *p = data, *end = data + len;
+    (void)off;
+
+    if (r->in_lead || !r->carry.empty()) {
+        const char *q = my_find_space(p, end);
+        std::string &head = r->in_lead ? r->lead : r->carry;
+        head.append(p, q - p);
+        if (q == end)
+            return 0;
+        if (!r->in_lead)
+            wf_word(r->t, r->carry.data(), r->carry.size());
+        r->carry.clear();
+        r->in_lead = false;
+        p = q;
+    }
+
+    for (;;) {
+        p = my_skip_space(p, end);
+        if (p == end)
+            break;
+        const char *q = my_find_space(p, end);
+        if (q == end) {
+            r->carry.assign(p, end);
+            break;
+        }
+        wf_word(r->t, p, q - p);
+        p = q;
+    }
+    return 0;
+}
+
+// Count the words of one file into tables[0..threads).
+static int wf_file(const char *filename, int threads, std::vector<wf_table> &tables) {
+    std::vector<wf_range> ranges(threads);
+    for (int i = 0; i < threads; i++) {
+        ranges[i].t = &tables[i];
+        ranges[i].in_lead = i > 0;
+    }
+    if (my_read_ranges(filename, threads, wf_chunk, ranges.data()) < 0)
+        return -1;
+
+    // Stitch the words that straddle range boundaries.
+    std::string pending;
+    for (int i = 0; i < threads; i++) {
+        wf_range *r = &ranges[i];
+        if (i > 0) {
+            pending += r->lead;
+            if (r->in_lead)
+                continue; // No space in this range; the word goes on.
+            if (!pending.empty())
+                wf_word(&tables[0], pending.data(), pending.size());
+        }
+        pending = r->carry;
+    }
+    if (!pending.empty())
+        wf_word(&tables[0], pending.data(), pending.size());
+    return 0;
+}
+
+static bool wf_before(const wf_entry *a, const wf_entry *b) {
+    if (a->count != b->count)
+        return a->count > b->count;
+    int c = memcmp(a->key, b->key, std::min(a->len, b->len));
+    return c != 0 ? c < 0 : a->len < b->len;
+}
+
+int main(int argc, char *argv[]) {
+    int threads = omp_get_max_threads();
+    long top = 10;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "k:j:")) != -1) {
+        switch (opt) {
+        case 'k':
+            top = atol(optarg);
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        default:
+            std::cerr << "Usage: " << argv[0] << " [-k top] [-j threads] <filename>...\n";
+            return 1;
+        }
+    }
+    if (optind >= argc || threads < 1 || top < 0) {
+        std::cerr << "Usage: " << argv[0] << " [-k top] [-j threads] <filename>...\n";
+        return 1;
+    }
+
+    std::vector<wf_table> tables(threads);
+    for (int i = 0; i < threads; i++)
+        wf_init(&tables[i]);
+    bool failed = false;
+    for (int i = optind; i < argc; i++)
+        if (wf_file(argv[i], threads, tables) < 0)
+            failed = true;
+
+    // Merge in parallel: each thread takes the words whose hash falls in its
+    // partition, so no two threads ever touch the same word.
+    std::vector<wf_table> parts(threads);
+#pragma omp parallel for schedule(static, 1) num_threads(threads)
+    for (int pt = 0; pt < threads; pt++) {
+        wf_init(&parts[pt]);
+        for (int i = 0; i < threads; i++)
+            for (size_t j = 0; j < tables[i].slots.size(); j++) {
+                const wf_entry *e = &tables[i].slots[j];
+                if (e->key && (e->hash >> 32) % threads == (uint64_t)pt)
+                    wf_add(&parts[pt], e->key, e->len, e->hash, e->count, true);
+            }
+    }
+
+    std::vector<const wf_entry *> all;
+    uint64_t words = 0;
+    for (int pt = 0; pt < threads; pt++)
+        for (size_t j = 0; j < parts[pt].slots.size(); j++)
+            if (parts[pt].slots[j].key) {
+                all.push_back(&parts[pt].slots[j]);
+                words += parts[pt].slots[j].count;
+            }
+    size_t k = top == 0 || (size_t)top > all.size() ? all.size() : top;
+    std::partial_sort(all.begin(), all.begin() + k, all.end(), wf_before);
+
+    std::string out;
+    char num[32];
+    for (size_t i = 0; i < k; i++) {
+        snprintf(num, sizeof(num), "%7llu ", (unsigned long long)all[i]->count);
+        out += num;
+        out.append(all[i]->key, all[i]->len);
+        out += '\n';
+    }
+    write(STDOUT_FILENO, out.data(), out.size());
+    std::cerr << words << " words, " << all.size() << " distinct\n";
+
+    for (int i = 0; i < threads; i++)
+        wf_free(&tables[i]);
+    return failed ? 1 : 0;
+}
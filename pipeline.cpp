@@ -0,0 +1,840 @@
+#include "my_io.h"
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Read pipelines. A source thread reads the file through its own ring into
+ * buffers from a fixed pool and hands them, in file order, to a chain of
+ * stages; the last stage feeds the consumer's my_pipe_view(). A stage either
+ * runs inline on the thread that feeds it or on its own thread behind a
+ * bounded queue. Buffers move by pointer: a stage passes a buffer on with
+ * my_stage_push(), returns it with my_stage_release(), or takes a fresh one
+ * from the pool with my_stage_buf().
+ *
+ * Backpressure: a full queue blocks whoever pushes into it, so a slow stage
+ * stalls the source, which then stops issuing reads. The pool is sized so
+ * that every queue, stage and in-flight read can hold its share at once.
+ *
+ * Inputs without a size (pipes, FIFOs, stdin, most of /proc) are streamed:
+ * reads at offset -1 until one completes empty. Where the kernel has it, one
+ * multishot read fills the free pool buffers provided to it; otherwise one
+ * plain read is in flight at a time, as concurrent reads of a pipe may
+ * complete out of order.
+ */
+#define PIPE_BGID 0
+// Multishot read came with Linux 6.7. The opcode number is ABI; older
+// headers just do not name it.
+#define PIPE_OP_READ_MULTISHOT 49
+#define PIPE_READ 1    // user_data of the multishot read,
+#define PIPE_PROVIDE 2 // of buffers given to it
+#define PIPE_CANCEL 3  // and of its cancellation
+#define PIPE_TIMER (~0ull)      // user_data of the throttle's refill timer,
+#define PIPE_LINK (~0ull - 1)   // of a read's timeout
+#define PIPE_ABORT (~0ull - 2)  // and of the cancel of an early close
+
+struct my_stage {
+  my_pipeline *pl;
+  int index;
+  const char *name;
+  my_stage_fn fn;
+  void *arg;
+  int mode;
+  size_t queue_len;
+  std::deque<my_buf *> q; // NULL marks the end of the stream
+  std::thread thread;
+  my_stage_stats stats;
+};
+
+struct my_pipeline {
+  int fd;
+  off_t file_sz;    // -1 for a stream
+  unsigned depth;   // Reads in flight, at most
+  bool adaptive;    // and fewer as qd allows
+  my_qd qd;
+  unsigned short ioprio; // Of every read
+  my_throttle throttle;  // Of reads by offset, under lock
+  double timeout_sec;    // Of each read by offset, 0 for none
+  struct __kernel_timespec link_ts;
+  my_ring_stats ring;    // Of the source's ring, once it is done, under lock
+  unsigned sector;  // O_DIRECT: reads are whole logical sectors
+  unsigned align;   // and buffers aligned to the physical sector
+  std::vector<my_stage *> stages; // The consumer's queue is the last one
+  std::vector<my_buf> bufs;
+  std::vector<my_buf *> free_bufs;
+  std::mutex lock;
+  std::condition_variable cv;
+  int err;
+  bool eof;
+  std::thread source;
+  my_stage_stats source_stats;
+  my_buf *held;
+};
+
+// Time inside stages run inline from the current stage, so it is not
+// counted twice.
+static thread_local double pipe_nested;
+
+static double pipe_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void pipe_fail(my_pipeline *pl, int err) {
+  std::lock_guard<std::mutex> guard(pl->lock);
+  if (!pl->err)
+    pl->err = err;
+  pl->cv.notify_all();
+}
+
+static my_buf *pipe_get_buf(my_pipeline *pl, my_stage_stats *who, bool wait) {
+  std::unique_lock<std::mutex> guard(pl->lock);
+  if (pl->free_bufs.empty() && wait && !pl->err) {
+    double t0 = pipe_now();
+    while (pl->free_bufs.empty() && !pl->err)
+      pl->cv.wait(guard);
+    who->blocked_sec += pipe_now() - t0;
+  }
+  if (pl->free_bufs.empty() || pl->err)
+    return NULL;
+  my_buf *buf = pl->free_bufs.back();
+  pl->free_bufs.pop_back();
+  buf->len = 0;
+  return buf;
+}
+
+static void pipe_put_buf(my_pipeline *pl, my_buf *buf) {
+  std::lock_guard<std::mutex> guard(pl->lock);
+  pl->free_bufs.push_back(buf);
+  pl->cv.notify_all();
+}
+
+static int pipe_deliver(my_pipeline *pl, my_stage_stats *from, int to,
+                        my_buf *buf);
+
+// Run st on buf; after the end of the stream has been through st, pass it on.
+static int pipe_run(my_stage *st, my_buf *buf) {
+  my_pipeline *pl = st->pl;
+  double outer = pipe_nested, t0 = pipe_now();
+  double blocked = st->stats.blocked_sec;
+  if (buf) {
+    st->stats.bufs++;
+    st->stats.bytes += buf->len;
+  }
+  pipe_nested = 0;
+  int ret = st->fn(st, buf, st->arg);
+  double t = pipe_now() - t0;
+  st->stats.busy_sec += t - pipe_nested - (st->stats.blocked_sec - blocked);
+  pipe_nested = outer + t;
+  if (ret) {
+    pipe_fail(pl, ret < 0 ? ret : -EIO);
+    return -1;
+  }
+  return buf ? 0 : pipe_deliver(pl, &st->stats, st->index + 1, NULL);
+}
+
+static int pipe_deliver(my_pipeline *pl, my_stage_stats *from, int to,
+                        my_buf *buf) {
+  my_stage *st = pl->stages[to];
+  if (st->mode == MY_STAGE_INLINE)
+    return pipe_run(st, buf);
+
+  std::unique_lock<std::mutex> guard(pl->lock);
+  if (st->q.size() >= st->queue_len && !pl->err) {
+    double t0 = pipe_now();
+    while (st->q.size() >= st->queue_len && !pl->err)
+      pl->cv.wait(guard);
+    from->blocked_sec += pipe_now() - t0;
+  }
+  if (pl->err) {
+    if (buf)
+      pl->free_bufs.push_back(buf);
+    return -1;
+  }
+  st->q.push_back(buf);
+  if (st->q.size() > st->stats.max_queued)
+    st->stats.max_queued = st->q.size();
+  pl->cv.notify_all();
+  return 0;
+}
+
+static void pipe_stage_thread(my_stage *st) {
+  my_pipeline *pl = st->pl;
+  for (;;) {
+    my_buf *buf;
+    {
+      std::unique_lock<std::mutex> guard(pl->lock);
+      while (st->q.empty() && !pl->err)
+        pl->cv.wait(guard);
+      if (pl->err)
+        return;
+      buf = st->q.front();
+      st->q.pop_front();
+      pl->cv.notify_all();
+    }
+    if (pipe_run(st, buf) < 0 || !buf)
+      return;
+  }
+}
+
+/*
+ * Queue the read of slot i; -1, with nothing queued, when there is no SQE
+ * for it. A read whose timeout cannot be queued still goes out, but fails
+ * the pipeline.
+ */
+static int pipe_prep_read(struct submitter *s, my_pipeline *pl, my_buf *buf,
+                          size_t want, int i) {
+  struct io_uring_sqe *sqe = app_get_sqe(s);
+  if (!sqe)
+    return -1;
+  // The last chunk of a file is asked for in whole sectors; the read stops
+  // at the end of the file anyway.
+  if (pl->sector > 1)
+    want = (want + pl->sector - 1) / pl->sector * pl->sector;
+  sqe->opcode = IORING_OP_READ;
+  sqe->ioprio = pl->ioprio;
+  sqe->fd = pl->fd;
+  sqe->addr = (unsigned long)(buf->data + buf->len);
+  sqe->len = want - buf->len;
+  sqe->off = buf->off + buf->len;
+  sqe->user_data = i;
+  if (pl->timeout_sec > 0 &&
+      app_link_timeout(s, sqe, &pl->link_ts, pl->timeout_sec, PIPE_LINK) < 0)
+    pipe_fail(pl, -errno);
+  return 0;
+}
+
+/*
+ * Keep up to pl->depth reads in flight and feed the first stage in file
+ * order. A new read needs a free buffer, so it only blocks for one when
+ * nothing is in flight. An adaptive pipeline times every read from
+ * submission to completion and keeps no more in flight than pl->qd allows.
+ * A read the throttle holds back arms a timer on the ring instead, and the
+ * source waits for it alongside the reads in flight. When the pipeline
+ * fails or is closed early, the reads in flight are cancelled.
+ */
+// The consumer may ask for the counters as soon as the last buffer is in.
+static void pipe_ring_done(my_pipeline *pl, struct submitter *s) {
+  std::lock_guard<std::mutex> guard(pl->lock);
+  pl->ring = s->stats;
+}
+
+static void pipe_source(my_pipeline *pl) {
+  my_stage_stats *st = &pl->source_stats;
+  struct submitter s;
+  unsigned depth = pl->depth;
+  std::vector<my_buf *> slot(depth);
+  std::vector<size_t> want(depth);
+  std::vector<bool> ready(depth);
+  std::vector<double> sent(depth);
+  long long nchunks = (pl->file_sz + PIPE_BUF_SZ - 1) / PIPE_BUF_SZ;
+  long long issued = 0, delivered = 0;
+  int inflight = 0;
+  struct __kernel_timespec timer_ts;
+  bool timer = false;
+
+  // A read with a timeout takes two entries.
+  if (app_setup_uring_ex(&s, pl->timeout_sec > 0 ? 2 * depth : depth, 0)) {
+    pipe_fail(pl, -ENOMEM);
+    return;
+  }
+  while (delivered < nchunks) {
+    while (issued < nchunks && issued - delivered < depth &&
+           (!pl->adaptive || inflight < (int)pl->qd.limit)) {
+      my_buf *buf = pipe_get_buf(pl, st, inflight == 0 && !timer);
+      if (!buf)
+        break;
+      int i = issued % depth;
+      off_t off = issued * (off_t)PIPE_BUF_SZ;
+      size_t len = pl->file_sz - off < PIPE_BUF_SZ ? pl->file_sz - off
+                                                   : PIPE_BUF_SZ;
+      double wait;
+      {
+        std::lock_guard<std::mutex> guard(pl->lock);
+        wait = my_throttle_take(&pl->throttle, len, pipe_now());
+      }
+      if (wait > 0) {
+        pipe_put_buf(pl, buf);
+        if (!timer && app_prep_timeout(&s, &timer_ts, wait, PIPE_TIMER) == 0)
+          timer = true;
+        break;
+      }
+      slot[i] = buf;
+      buf->off = off;
+      want[i] = len;
+      ready[i] = false;
+      if (pipe_prep_read(&s, pl, buf, want[i], i) < 0) {
+        pipe_fail(pl, -errno);
+        pipe_put_buf(pl, buf);
+        break;
+      }
+      sent[i] = pipe_now();
+      issued++;
+      inflight++;
+    }
+    if (inflight == 0 && !timer)
+      break; // Failed while waiting for a buffer
+
+    struct io_uring_cqe *cqe;
+    if (app_submit_and_wait(&s, 1) < 0 || app_wait_cqe(&s, &cqe) < 0) {
+      pipe_fail(pl, -EIO);
+      break;
+    }
+    do {
+      if (cqe->user_data == PIPE_TIMER || cqe->user_data == PIPE_LINK) {
+        if (cqe->user_data == PIPE_TIMER)
+          timer = false;
+        app_cqe_seen(&s);
+        continue;
+      }
+      int i = (int)cqe->user_data;
+      int res = cqe->res;
+      app_cqe_seen(&s);
+      inflight--;
+      if (res < 0) {
+        // Nothing but its timeout cancels a read while the pipeline runs.
+        pipe_fail(pl, res == -ECANCELED ? -ETIMEDOUT : res);
+        continue;
+      }
+      if (pl->adaptive) {
+        double now = pipe_now();
+        my_qd_complete(&pl->qd, now - sent[i], res, now);
+      }
+      slot[i]->len += res;
+      if (res > 0 && slot[i]->len < want[i]) {
+        if (pipe_prep_read(&s, pl, slot[i], want[i], i) < 0) {
+          pipe_fail(pl, -errno);
+          continue;
+        }
+        sent[i] = pipe_now();
+        inflight++;
+        continue;
+      }
+      ready[i] = true;
+    } while (app_peek_cqe(&s, &cqe) == 0);
+
+    while (delivered < issued && ready[delivered % depth]) {
+      my_buf *buf = slot[delivered % depth];
+      st->bufs++;
+      st->bytes += buf->len;
+      delivered++;
+      if (pipe_deliver(pl, st, 0, buf) < 0)
+        break;
+    }
+    if (pl->err)
+      break;
+  }
+  if (delivered == nchunks)
+    pipe_deliver(pl, st, 0, NULL);
+
+  // Cancel what is still in flight, and reap it and the cancel before its
+  // buffers go back to the pool.
+  int cancels = inflight > 0 && app_cancel(&s, 0, true, PIPE_ABORT) == 0;
+  while (inflight > 0 || cancels > 0) {
+    struct io_uring_cqe *cqe;
+    if (app_wait_cqe(&s, &cqe) < 0)
+      break;
+    if (cqe->user_data == PIPE_ABORT)
+      cancels--;
+    else if (cqe->user_data != PIPE_TIMER && cqe->user_data != PIPE_LINK)
+      inflight--;
+    app_cqe_seen(&s);
+  }
+  for (; delivered < issued; delivered++)
+    pipe_put_buf(pl, slot[delivered % depth]);
+  pipe_ring_done(pl, &s);
+  app_teardown_uring(&s);
+}
+
+// Plain reads at the current position, one at a time, each delivered as is.
+static void pipe_stream_reads(my_pipeline *pl, struct submitter *s) {
+  my_stage_stats *st = &pl->source_stats;
+  off_t pos = 0;
+  for (;;) {
+    my_buf *buf = pipe_get_buf(pl, st, true);
+    if (!buf)
+      return;
+    struct io_uring_sqe *sqe = app_get_sqe(s);
+    struct io_uring_cqe *cqe;
+    if (!sqe) {
+      pipe_fail(pl, -errno);
+      pipe_put_buf(pl, buf);
+      return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->ioprio = pl->ioprio;
+    sqe->fd = pl->fd;
+    sqe->addr = (unsigned long)buf->data;
+    sqe->len = buf->cap;
+    sqe->off = (unsigned long long)-1;
+    if (app_submit_and_wait(s, 1) < 0 || app_wait_cqe(s, &cqe) < 0) {
+      pipe_put_buf(pl, buf);
+      pipe_fail(pl, -EIO);
+      return;
+    }
+    int res = cqe->res;
+    app_cqe_seen(s);
+    if (res <= 0) {
+      pipe_put_buf(pl, buf);
+      if (res < 0 && res != -EINTR && res != -EAGAIN) {
+        pipe_fail(pl, res);
+        return;
+      }
+      if (res == 0) {
+        pipe_deliver(pl, st, 0, NULL);
+        return;
+      }
+      continue;
+    }
+    buf->len = res;
+    buf->off = pos;
+    pos += res;
+    st->bufs++;
+    st->bytes += res;
+    if (pipe_deliver(pl, st, 0, buf) < 0)
+      return;
+  }
+}
+
+/*
+ * One multishot read over the free pool buffers, handed to the kernel with
+ * IORING_OP_PROVIDE_BUFFERS. When downstream holds every buffer the kernel
+ * ends the read with -ENOBUFS; it is rearmed once buffers come back. Returns
+ * 1, having read nothing, when the kernel or the file does not support it.
+ */
+static int pipe_stream_multishot(my_pipeline *pl, struct submitter *s) {
+  my_stage_stats *st = &pl->source_stats;
+  std::vector<bool> given(pl->bufs.size(), false);
+  size_t provided = 0;
+  int pending = 0; // PROVIDE_BUFFERS and cancel requests in flight
+  bool armed = false, started = false;
+  off_t pos = 0;
+  int ret = 0;
+  for (;;) {
+    // Hand every free buffer to the kernel; wait for one if it has none.
+    my_buf *buf;
+    int queued = 0;
+    while ((buf = pipe_get_buf(pl, st, provided == 0)) != NULL) {
+      struct io_uring_sqe *sqe = app_get_sqe(s);
+      if (!sqe) {
+        pipe_fail(pl, -errno);
+        pipe_put_buf(pl, buf);
+        break;
+      }
+      int bid = buf - pl->bufs.data();
+      sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+      sqe->fd = 1;
+      sqe->addr = (unsigned long)buf->data;
+      sqe->len = buf->cap;
+      sqe->off = bid;
+      sqe->buf_group = PIPE_BGID;
+      sqe->user_data = PIPE_PROVIDE;
+      given[bid] = true;
+      provided++;
+      pending++;
+      if (++queued + 1 == (int)pl->depth)
+        break; // Leave room in the SQ ring for the read
+    }
+    if (provided == 0 || pl->err)
+      break; // Failed while waiting for a buffer or queueing one
+    if (!armed) {
+      struct io_uring_sqe *sqe = app_get_sqe(s);
+      if (!sqe) {
+        pipe_fail(pl, -errno);
+        break;
+      }
+      sqe->opcode = PIPE_OP_READ_MULTISHOT;
+      sqe->ioprio = pl->ioprio;
+      sqe->fd = pl->fd;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = PIPE_BGID;
+      sqe->user_data = PIPE_READ;
+      armed = true;
+    }
+
+    struct io_uring_cqe *cqe;
+    if (app_submit_and_wait(s, 1) < 0 || app_wait_cqe(s, &cqe) < 0) {
+      pipe_fail(pl, -EIO);
+      break;
+    }
+    bool done = false;
+    do {
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+      bool read = cqe->user_data == PIPE_READ;
+      app_cqe_seen(s);
+      if (!read) {
+        pending--;
+        if (res < 0) {
+          pipe_fail(pl, res);
+          done = true;
+        }
+        continue;
+      }
+      if (!(flags & IORING_CQE_F_MORE))
+        armed = false;
+      if (res > 0) {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        buf = &pl->bufs[bid];
+        given[bid] = false;
+        provided--;
+        started = true;
+        buf->len = res;
+        buf->off = pos;
+        pos += res;
+        st->bufs++;
+        st->bytes += res;
+        if (pipe_deliver(pl, st, 0, buf) < 0)
+          done = true;
+      } else if (res == 0 && !armed) {
+        pipe_deliver(pl, st, 0, NULL);
+        done = true;
+      } else if (res < 0 && res != -ENOBUFS && res != -EINTR &&
+                 res != -EAGAIN) {
+        if (!started && (res == -EINVAL || res == -EOPNOTSUPP ||
+                         res == -EBADFD || res == -EBADF))
+          ret = 1;
+        else
+          pipe_fail(pl, res);
+        done = true;
+      }
+    } while (!done && app_peek_cqe(s, &cqe) == 0);
+    if (done || pl->err)
+      break;
+  }
+
+  // Nothing may land in a buffer after the pool is freed.
+  if (armed) {
+    struct io_uring_sqe *sqe = app_get_sqe(s);
+    if (sqe) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = PIPE_READ;
+      sqe->user_data = PIPE_CANCEL;
+      pending++;
+    } else {
+      pipe_fail(pl, -errno);
+    }
+  }
+  struct io_uring_cqe *cqe;
+  while ((armed || pending > 0) && app_submit_and_wait(s, 1) >= 0 &&
+         app_wait_cqe(s, &cqe) == 0) {
+    if (cqe->user_data != PIPE_READ) {
+      pending--;
+    } else {
+      if (!(cqe->flags & IORING_CQE_F_MORE))
+        armed = false;
+      if (cqe->res > 0)
+        given[cqe->flags >> IORING_CQE_BUFFER_SHIFT] = true;
+    }
+    app_cqe_seen(s);
+  }
+  // Provided buffers are only written by buffer-select reads, and none are
+  // left, so the kernel's share can go back to the pool.
+  for (size_t i = 0; i < given.size(); i++)
+    if (given[i])
+      pipe_put_buf(pl, &pl->bufs[i]);
+  return ret;
+}
+
+static void pipe_stream(my_pipeline *pl) {
+  struct submitter s;
+  if (app_setup_uring_ex(&s, pl->depth, 0)) {
+    pipe_fail(pl, -ENOMEM);
+    return;
+  }
+  // Multishot reads are for what can be polled: sockets, ttys and other
+  // character devices. On a pipe the read misses the writer closing it (the
+  // hangup wakes its poll without POLLIN, so EOF never completes), and a
+  // file in /proc can end it at once with nothing read. Both take plain
+  // reads.
+  struct stat st;
+  bool pollable = fstat(pl->fd, &st) == 0 &&
+                  (S_ISSOCK(st.st_mode) || S_ISCHR(st.st_mode));
+  if (!pollable || pipe_stream_multishot(pl, &s) == 1)
+    pipe_stream_reads(pl, &s);
+  pipe_ring_done(pl, &s);
+  app_teardown_uring(&s);
+}
+
+my_pipeline *my_pipe_open(const char *filename) {
+  return my_pipe_open_ex(filename, 0, PIPE_DEPTH);
+}
+
+/*
+ * MY_PIPE_DIRECT reads past the page cache with O_DIRECT, in chunks aligned
+ * to the sector sizes. With a deep queue (PIPE_SCAN_DEPTH) that is the scan
+ * mode for raw volumes and partitions: every chunk of the device is asked
+ * for once and the device always has work queued. MY_PIPE_ADAPTIVE makes
+ * depth a ceiling: the reads in flight start at one and follow completion
+ * latency, so a scan of shared storage backs off when others queue behind it.
+ */
+my_pipeline *my_pipe_open_ex(const char *filename, unsigned flags,
+                             unsigned depth) {
+  // "-" is stdin; the pipeline gets a descriptor of its own to close.
+  int oflags = O_RDONLY | (flags & MY_PIPE_DIRECT ? O_DIRECT : 0);
+  int fd = strcmp(filename, "-") == 0 ? dup(STDIN_FILENO)
+                                      : open(filename, oflags);
+  if (fd < 0) {
+    perror(filename);
+    return NULL;
+  }
+  my_pipeline *pl = my_pipe_fdopen(fd);
+  if (!pl) {
+    perror(filename);
+    close(fd);
+    return NULL;
+  }
+  pl->depth = depth ? depth : PIPE_DEPTH;
+  pl->adaptive = flags & MY_PIPE_ADAPTIVE;
+  my_qd_init(&pl->qd, pl->depth, 0);
+  if (flags & MY_PIPE_DIRECT) {
+    unsigned logical, physical;
+    if (my_sector_sizes(fd, &logical, &physical) < 0 ||
+        PIPE_BUF_SZ % logical || PIPE_BUF_SZ % physical) {
+      fprintf(stderr, "%s: unsupported sector size\n", filename);
+      my_pipe_close(pl);
+      return NULL;
+    }
+    pl->sector = logical;
+    pl->align = physical > BLOCK_SZ ? physical : BLOCK_SZ;
+  }
+  return pl;
+}
+
+// Pipeline over fd, which it closes. Sized regular files and block devices
+// are read ahead by offset; anything else is streamed.
+my_pipeline *my_pipe_fdopen(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    return NULL;
+  off_t size = -1;
+  if (S_ISBLK(st.st_mode))
+    size = get_file_size(fd);
+  else if (S_ISREG(st.st_mode) && st.st_size > 0)
+    size = st.st_size;
+  my_pipeline *pl = new my_pipeline();
+  pl->fd = fd;
+  pl->file_sz = size;
+  pl->depth = PIPE_DEPTH;
+  pl->sector = 1;
+  pl->align = BLOCK_SZ;
+  return pl;
+}
+
+/*
+ * Append a stage. MY_STAGE_THREAD runs fn on a thread of its own fed through
+ * a queue of queue_len buffers; MY_STAGE_INLINE runs it on the caller of the
+ * previous stage's my_stage_push().
+ */
+int my_pipe_add_stage(my_pipeline *pl, const char *name, my_stage_fn fn,
+                      void *arg, int mode, unsigned queue_len) {
+  my_stage *st = new my_stage();
+  st->pl = pl;
+  st->index = pl->stages.size();
+  st->name = name;
+  st->fn = fn;
+  st->arg = arg;
+  st->mode = mode;
+  st->queue_len = queue_len ? queue_len : 1;
+  pl->stages.push_back(st);
+  return st->index;
+}
+
+// Latency target of an adaptive pipeline, before my_pipe_start().
+int my_pipe_set_latency(my_pipeline *pl, double target_sec) {
+  if (!pl->adaptive || pl->source.joinable()) {
+    errno = EINVAL;
+    return -1;
+  }
+  pl->qd.target_sec = target_sec;
+  return 0;
+}
+
+// Priority class of the pipeline's reads, before my_pipe_start(): a bulk scan
+// at MY_PRIO_IDLE leaves the device to everything else.
+int my_pipe_set_prio(my_pipeline *pl, int prio) {
+  if (pl->source.joinable() || prio < MY_PRIO_NONE || prio > MY_PRIO_IDLE) {
+    errno = EINVAL;
+    return -1;
+  }
+  pl->ioprio = my_ioprio(prio);
+  return 0;
+}
+
+/*
+ * Limit the reads of a pipeline over a file or device to bytes_per_sec and
+ * iops, 0 for no limit. May be called again while it runs, from any thread;
+ * streamed input is not limited.
+ */
+int my_pipe_set_rate(my_pipeline *pl, double bytes_per_sec, double iops) {
+  if (bytes_per_sec < 0 || iops < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  std::lock_guard<std::mutex> guard(pl->lock);
+  if (!pl->throttle.bytes_per_sec && !pl->throttle.iops)
+    my_throttle_init(&pl->throttle, bytes_per_sec, iops);
+  else
+    my_throttle_set(&pl->throttle, bytes_per_sec, iops);
+  return 0;
+}
+
+// Fail the pipeline with ETIMEDOUT when a read by offset takes longer than
+// timeout_sec, 0 for no limit. Before my_pipe_start().
+int my_pipe_set_timeout(my_pipeline *pl, double timeout_sec) {
+  if (pl->source.joinable() || timeout_sec < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  pl->timeout_sec = timeout_sec;
+  return 0;
+}
+
+int my_pipe_start(my_pipeline *pl) {
+  // The consumer's queue, never full: the pool bounds it.
+  my_stage *sink = new my_stage();
+  sink->pl = pl;
+  sink->index = pl->stages.size();
+  sink->name = "consumer";
+  sink->mode = MY_STAGE_THREAD;
+  sink->queue_len = (size_t)-1;
+  pl->stages.push_back(sink);
+
+  size_t nbufs = pl->depth + 2;
+  for (size_t i = 0; i + 1 < pl->stages.size(); i++)
+    nbufs += 2 + (pl->stages[i]->mode == MY_STAGE_THREAD
+                      ? pl->stages[i]->queue_len
+                      : 0);
+  pl->bufs.resize(nbufs);
+  for (size_t i = 0; i < nbufs; i++) {
+    my_buf *buf = &pl->bufs[i];
+    if (posix_memalign((void **)&buf->data, pl->align, PIPE_BUF_SZ)) {
+      perror("posix_memalign");
+      return -1;
+    }
+    buf->cap = PIPE_BUF_SZ;
+    pl->free_bufs.push_back(buf);
+  }
+
+  for (size_t i = 0; i + 1 < pl->stages.size(); i++)
+    if (pl->stages[i]->mode == MY_STAGE_THREAD)
+      pl->stages[i]->thread = std::thread(pipe_stage_thread, pl->stages[i]);
+  pl->source = std::thread(pl->file_sz < 0 ? pipe_stream : pipe_source, pl);
+  return 0;
+}
+
+int my_stage_push(my_stage *st, my_buf *buf) {
+  return pipe_deliver(st->pl, &st->stats, st->index + 1, buf);
+}
+
+my_buf *my_stage_buf(my_stage *st) {
+  return pipe_get_buf(st->pl, &st->stats, true);
+}
+
+void my_stage_release(my_stage *st, my_buf *buf) { pipe_put_buf(st->pl, buf); }
+
+// Next buffer out of the last stage; the previous one goes back to the pool.
+ssize_t my_pipe_view(my_pipeline *pl, const char **data) {
+  if (pl->held) {
+    pipe_put_buf(pl, pl->held);
+    pl->held = NULL;
+  }
+  if (pl->eof)
+    return 0;
+
+  my_stage *sink = pl->stages.back();
+  std::unique_lock<std::mutex> guard(pl->lock);
+  while (sink->q.empty() && !pl->err)
+    pl->cv.wait(guard);
+  if (pl->err) {
+    errno = -pl->err;
+    return -1;
+  }
+  my_buf *buf = sink->q.front();
+  sink->q.pop_front();
+  if (!buf) {
+    pl->eof = true;
+    return 0;
+  }
+  pl->held = buf;
+  *data = buf->data;
+  return buf->len;
+}
+
+// Counters of stage i, or of the source for i < 0, once the stream is done.
+int my_pipe_stats(my_pipeline *pl, int i, my_stage_stats *st) {
+  if (i >= (int)pl->stages.size() - 1) {
+    errno = EINVAL;
+    return -1;
+  }
+  *st = i < 0 ? pl->source_stats : pl->stages[i]->stats;
+  return 0;
+}
+
+// The depth controller of an adaptive pipeline, once the stream is done.
+int my_pipe_qd(my_pipeline *pl, my_qd *qd) {
+  if (!pl->adaptive) {
+    errno = EINVAL;
+    return -1;
+  }
+  *qd = pl->qd;
+  return 0;
+}
+
+// The throttle's limits and counters so far.
+int my_pipe_throttle(my_pipeline *pl, my_throttle *t) {
+  std::lock_guard<std::mutex> guard(pl->lock);
+  *t = pl->throttle;
+  return 0;
+}
+
+// Submission counters of the source's ring, once the stream is done.
+int my_pipe_ring(my_pipeline *pl, my_ring_stats *st) {
+  std::lock_guard<std::mutex> guard(pl->lock);
+  *st = pl->ring;
+  return 0;
+}
+
+const char *my_pipe_stage_name(my_pipeline *pl, int i) {
+  return i < 0 ? "source" : pl->stages[i]->name;
+}
+
+int my_pipe_stages(my_pipeline *pl) { return (int)pl->stages.size() - 1; }
+
+void my_pipe_close(my_pipeline *pl) {
+  if (!pl)
+    return;
+  if (!pl->eof)
+    pipe_fail(pl, -ECANCELED); // Wakes everything still running
+  if (pl->source.joinable())
+    pl->source.join();
+  for (size_t i = 0; i < pl->stages.size(); i++) {
+    if (pl->stages[i]->thread.joinable())
+      pl->stages[i]->thread.join();
+    delete pl->stages[i];
+  }
+  for (size_t i = 0; i < pl->bufs.size(); i++)
+    free(pl->bufs[i].data);
+  close(pl->fd);
+  delete pl;
+}
+
+// Built-in stage: CRC32C of the stream into *(uint32_t *)arg, data unchanged.
+int my_stage_crc32c(my_stage *st, my_buf *buf, void *arg) {
+  if (!buf)
+    return 0;
+  uint32_t *crc = static_cast<uint32_t *>(arg);
+  *crc = my_crc32c(*crc, buf->data, buf->len);
+  return my_stage_push(st, buf) < 0 ? -ECANCELED : 0;
+}
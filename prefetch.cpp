@@ -0,0 +1,134 @@
+#include "my_io.h"
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Page cache hints. One process-wide ring carries IORING_OP_FADVISE and
+ * IORING_OP_MADVISE requests, so a hint costs the caller an SQE rather than
+ * the readahead it starts. Files opened for a hint stay open until their
+ * completion is reaped, which happens on later calls or in
+ * my_prefetch_wait().
+ */
+#define PF_DEPTH 64
+#define PF_KEEP_FD (1ull << 32) // user_data: the fd belongs to the caller
+
+static std::mutex pf_lock;
+static struct submitter pf_ring;
+static bool pf_ready;
+static unsigned pf_inflight;
+
+static void pf_complete(struct io_uring_cqe *cqe) {
+  unsigned long long ud = cqe->user_data;
+  if (!(ud & PF_KEEP_FD))
+    close((int)ud);
+  pf_inflight--;
+  app_cqe_seen(&pf_ring);
+}
+
+static void pf_reap() {
+  struct io_uring_cqe *cqe;
+  while (app_peek_cqe(&pf_ring, &cqe) == 0)
+    pf_complete(cqe);
+}
+
+// An SQE on the hint ring, making room by waiting when it is full.
+static struct io_uring_sqe *pf_sqe() {
+  if (!pf_ready) {
+    if (app_setup_uring_ex(&pf_ring, PF_DEPTH, 0))
+      return NULL;
+    pf_ready = true;
+  }
+  pf_reap();
+  while (pf_inflight >= PF_DEPTH) {
+    struct io_uring_cqe *cqe;
+    if (app_wait_cqe(&pf_ring, &cqe) < 0)
+      return NULL;
+    pf_complete(cqe);
+  }
+  struct io_uring_sqe *sqe = app_get_sqe(&pf_ring);
+  if (sqe)
+    pf_inflight++;
+  return sqe;
+}
+
+// The sqe's len is 32 bits; longer ranges run to the end of the file.
+static void pf_prep_fadvise(struct io_uring_sqe *sqe, int fd, off_t off,
+                            off_t len, int advice, unsigned long long ud) {
+  sqe->opcode = IORING_OP_FADVISE;
+  sqe->fd = fd;
+  sqe->off = off;
+  sqe->len = len > 0xffffffffLL ? 0 : len;
+  sqe->fadvise_advice = advice;
+  sqe->user_data = ud;
+}
+
+static int pf_path(const char *path, off_t off, off_t len, int advice) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+  std::lock_guard<std::mutex> guard(pf_lock);
+  struct io_uring_sqe *sqe = pf_sqe();
+  if (!sqe) {
+    close(fd);
+    return -1;
+  }
+  pf_prep_fadvise(sqe, fd, off, len, advice, (unsigned)fd);
+  return app_submit(&pf_ring) < 0 ? -1 : 0;
+}
+
+/*
+ * Start reading len bytes at off of path into the page cache
+ * (POSIX_FADV_WILLNEED); len 0 means to the end of the file. Returns once
+ * the request is queued.
+ */
+int my_prefetch(const char *path, off_t off, off_t len) {
+  return pf_path(path, off, len, POSIX_FADV_WILLNEED);
+}
+
+// As my_prefetch(), for an open file; on the mmap engine the mapping itself
+// is advised.
+int my_prefetch_file(my_file *mf, off_t off, off_t len) {
+  std::lock_guard<std::mutex> guard(pf_lock);
+  struct io_uring_sqe *sqe = pf_sqe();
+  if (!sqe)
+    return -1;
+  if (mf->map) {
+    if (off >= (off_t)mf->map_sz) {
+      sqe->opcode = IORING_OP_NOP;
+    } else {
+      if (len == 0 || off + len > (off_t)mf->map_sz)
+        len = mf->map_sz - off;
+      sqe->opcode = IORING_OP_MADVISE;
+      sqe->addr = (unsigned long)((char *)mf->map + off);
+      sqe->len = len;
+      sqe->fadvise_advice = MADV_WILLNEED;
+    }
+    sqe->user_data = PF_KEEP_FD;
+  } else {
+    pf_prep_fadvise(sqe, mf->fd, off, len, POSIX_FADV_WILLNEED,
+                    PF_KEEP_FD | (unsigned)mf->fd);
+  }
+  return app_submit(&pf_ring) < 0 ? -1 : 0;
+}
+
+// Drop a file read in one pass from the page cache (POSIX_FADV_DONTNEED).
+int my_drop_cache(const char *path) {
+  return pf_path(path, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+// Wait for every hint queued so far. A caller's fd must outlive its hints.
+void my_prefetch_wait() {
+  std::lock_guard<std::mutex> guard(pf_lock);
+  while (pf_ready && pf_inflight > 0) {
+    struct io_uring_cqe *cqe;
+    if (app_wait_cqe(&pf_ring, &cqe) < 0)
+      break;
+    pf_complete(cqe);
+  }
+}
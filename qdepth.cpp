@@ -0,0 +1,71 @@
+#include "my_io.h"
+
+/*
+ * Queue depth that follows completion latency, AIMD style. Completions are
+ * taken in rounds of one limit's worth. After each round the limit doubles
+ * (slow start) or grows by one while throughput still rises and the round's
+ * mean latency stays under the target. It is halved when latency goes over
+ * the target, and held when throughput has stopped rising. Without a target
+ * of its own the controller aims at QD_TARGET_FACTOR times its fastest
+ * completion, but not under QD_TARGET_FLOOR.
+ */
+#define QD_TARGET_FACTOR 4
+#define QD_TARGET_FLOOR 500e-6
+#define QD_GAIN 1.05 // Throughput has to rise this much to count as growing
+
+void my_qd_init(my_qd *qd, unsigned max_limit, double target_sec) {
+  *qd = my_qd();
+  qd->max_limit = max_limit ? max_limit : 1;
+  qd->limit = 1;
+  qd->peak_limit = 1;
+  qd->target_sec = target_sec;
+  qd->slow_start = true;
+}
+
+// The target in force: the caller's, or one derived from the fastest
+// completion so far.
+double my_qd_target(const my_qd *qd) {
+  if (qd->target_sec > 0)
+    return qd->target_sec;
+  double t = qd->base_sec * QD_TARGET_FACTOR;
+  return t > QD_TARGET_FLOOR ? t : QD_TARGET_FLOOR;
+}
+
+// A request of bytes completed lat_sec after it was submitted; now is the
+// time of its completion on the same clock.
+void my_qd_complete(my_qd *qd, double lat_sec, size_t bytes, double now) {
+  qd->completions++;
+  qd->lat_sum += lat_sec;
+  if (lat_sec > qd->lat_max)
+    qd->lat_max = lat_sec;
+  if (!qd->base_sec || lat_sec < qd->base_sec)
+    qd->base_sec = lat_sec;
+  if (!qd->round_n)
+    qd->round_start = now - lat_sec;
+  qd->round_n++;
+  qd->round_bytes += bytes;
+  qd->round_lat += lat_sec;
+  if (qd->round_n < qd->limit || now <= qd->round_start)
+    return;
+
+  double tput = qd->round_bytes / (now - qd->round_start);
+  double mean = qd->round_lat / qd->round_n;
+  if (mean > my_qd_target(qd)) {
+    qd->limit = qd->limit > 1 ? qd->limit / 2 : 1;
+    qd->slow_start = false;
+    qd->decreases++;
+  } else if (tput > qd->last_tput * QD_GAIN && qd->limit < qd->max_limit) {
+    qd->limit = qd->slow_start ? qd->limit * 2 : qd->limit + 1;
+    if (qd->limit > qd->max_limit)
+      qd->limit = qd->max_limit;
+    qd->increases++;
+  } else {
+    qd->slow_start = false;
+  }
+  if (qd->limit > qd->peak_limit)
+    qd->peak_limit = qd->limit;
+  qd->last_tput = tput;
+  qd->round_n = 0;
+  qd->round_bytes = 0;
+  qd->round_lat = 0;
+}
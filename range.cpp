@@ -0,0 +1,427 @@
+#include "my_io.h"
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <omp.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+/*
+ * Parallel reads of a single file. Every worker owns a ring and a window of
+ * up to RANGE_DEPTH chunk buffers, and reads the chunks at first, first +
+ * stride, first + 2 * stride, ... up to end. A worker with fewer chunks than
+ * that gets one buffer per chunk, each no bigger than its range.
+ *
+ *  - my_read_ranges() gives each worker one contiguous byte range and calls
+ *    back on the worker thread, chunk by chunk in file order within a range.
+ *  - my_ropen() interleaves chunks across workers (chunk i belongs to worker
+ *    i % N) so the caller can consume one ordered stream. With
+ *    MY_RANGE_CRC32C each worker checksums a chunk as soon as its read
+ *    completes, and the chunk CRCs are combined once the stream is drained.
+ */
+#define RANGE_CANCEL (~0ull) // user_data of the cancel when stopped early
+
+enum { SLOT_FREE, SLOT_INFLIGHT, SLOT_READY };
+
+struct range_slot {
+  char *buf;
+  off_t off;
+  unsigned len;
+  unsigned filled;
+  int state;
+};
+
+struct range_worker {
+  int fd;
+  int id;
+  off_t first;
+  off_t stride;
+  off_t end;
+  size_t chunk;
+  long long nchunks;
+  int depth;      // Slots in use, at most RANGE_DEPTH
+  uint32_t *crcs; // Per-chunk CRC32C, indexed by chunk from base, or NULL
+  off_t base;
+  struct range_slot slots[RANGE_DEPTH];
+  std::mutex lock;
+  std::condition_variable cv;
+  int err;
+  bool stop;
+  std::thread thread;
+};
+
+struct my_range_reader {
+  int fd;
+  off_t file_sz;
+  int nworkers;
+  long long nchunks;
+  long long cur;
+  off_t start;
+  uint32_t *crcs;
+  size_t held_off;
+  struct range_slot *held;
+  struct range_worker *held_worker;
+  struct range_worker *workers;
+};
+
+static int range_worker_init(struct range_worker *w, int fd, int id,
+                             off_t first, off_t stride, off_t end,
+                             size_t chunk) {
+  w->fd = fd;
+  w->id = id;
+  w->first = first;
+  w->stride = stride;
+  w->end = end;
+  w->chunk = chunk;
+  w->nchunks = first < end ? (end - first + stride - 1) / stride : 0;
+  w->depth = w->nchunks < RANGE_DEPTH ? (int)w->nchunks : RANGE_DEPTH;
+  w->crcs = NULL;
+  w->base = 0;
+  w->err = 0;
+  w->stop = false;
+  size_t buf_sz = end - first < (off_t)chunk ? end - first : chunk;
+  for (int i = 0; i < w->depth; i++) {
+    w->slots[i].state = SLOT_FREE;
+    if (posix_memalign((void **)&w->slots[i].buf, BLOCK_SZ, buf_sz)) {
+      while (i--)
+        free(w->slots[i].buf);
+      return -ENOMEM;
+    }
+  }
+  return 0;
+}
+
+static void range_worker_free(struct range_worker *w) {
+  for (int i = 0; i < w->depth; i++)
+    free(w->slots[i].buf);
+}
+
+static int range_prep_read(struct submitter *s, struct range_worker *w,
+                           int i) {
+  struct range_slot *sl = &w->slots[i];
+  struct io_uring_sqe *sqe = app_get_sqe(s);
+  if (!sqe)
+    return -errno;
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = w->fd;
+  sqe->addr = (unsigned long)(sl->buf + sl->filled);
+  sqe->len = sl->len - sl->filled;
+  sqe->off = sl->off + sl->filled;
+  sqe->user_data = i;
+  return 0;
+}
+
+/*
+ * Keep up to depth reads of this worker's chunks in flight. With a
+ * callback, ready chunks are delivered here in order and recycled at once;
+ * without one, the consumer of the ordered stream frees them.
+ */
+static void range_run(struct range_worker *w, my_range_fn fn, void *arg) {
+  struct submitter s;
+  long long issued = 0, delivered = 0;
+  int inflight = 0;
+
+  if (app_setup_uring_ex(&s, w->depth ? w->depth : 1, 0)) {
+    std::lock_guard<std::mutex> guard(w->lock);
+    w->err = -ENOMEM;
+    w->cv.notify_all();
+    return;
+  }
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> guard(w->lock);
+      while (!w->stop && !w->err && issued < w->nchunks &&
+             w->slots[issued % w->depth].state == SLOT_FREE) {
+        int i = issued % w->depth;
+        struct range_slot *sl = &w->slots[i];
+        sl->off = w->first + issued * w->stride;
+        sl->len = sl->off + (off_t)w->chunk > w->end ? w->end - sl->off
+                                                      : w->chunk;
+        sl->filled = 0;
+        int err = range_prep_read(&s, w, i);
+        if (err < 0) {
+          w->err = err;
+          w->cv.notify_all();
+          break;
+        }
+        sl->state = SLOT_INFLIGHT;
+        issued++;
+        inflight++;
+      }
+      if (w->stop)
+        break; // Nobody wants what is in flight any more
+      if (inflight == 0) {
+        if (w->err || issued == w->nchunks)
+          break;
+        // Every buffer is waiting on the consumer.
+        w->cv.wait(guard);
+        continue;
+      }
+    }
+
+    struct io_uring_cqe *cqe;
+    if (app_submit(&s) < 0 || app_wait_cqe(&s, &cqe) < 0) {
+      std::lock_guard<std::mutex> guard(w->lock);
+      w->err = -EIO;
+      w->cv.notify_all();
+      break;
+    }
+    do {
+      int i = (int)cqe->user_data;
+      int res = cqe->res;
+      struct range_slot *sl = &w->slots[i];
+      app_cqe_seen(&s);
+      inflight--;
+
+      if (res > 0 && sl->filled + res < sl->len) {
+        sl->filled += res;
+        if ((res = range_prep_read(&s, w, i)) == 0) {
+          inflight++;
+          continue;
+        }
+      }
+      if (res >= 0 && w->crcs)
+        w->crcs[(sl->off - w->base) / w->chunk] =
+            my_crc32c(0, sl->buf, sl->filled + res);
+      std::lock_guard<std::mutex> guard(w->lock);
+      if (res < 0)
+        w->err = res;
+      else
+        sl->filled += res;
+      sl->state = SLOT_READY;
+      w->cv.notify_all();
+    } while (app_peek_cqe(&s, &cqe) == 0);
+
+    while (fn && !w->err && delivered < issued &&
+           w->slots[delivered % w->depth].state == SLOT_READY) {
+      struct range_slot *sl = &w->slots[delivered % w->depth];
+      if (fn(sl->buf, sl->filled, sl->off, w->id, arg))
+        w->stop = true;
+      sl->state = SLOT_FREE;
+      delivered++;
+    }
+  }
+
+  // Cancel anything still in flight, and reap it and the cancel before the
+  // buffers can be reused.
+  int cancels = inflight > 0 && app_cancel(&s, 0, true, RANGE_CANCEL) == 0;
+  while (inflight > 0 || cancels > 0) {
+    struct io_uring_cqe *cqe;
+    if (app_wait_cqe(&s, &cqe) < 0)
+      break;
+    if (cqe->user_data == RANGE_CANCEL)
+      cancels--;
+    else
+      inflight--;
+    app_cqe_seen(&s);
+  }
+  app_teardown_uring(&s);
+}
+
+static int range_open(const char *filename, off_t *file_sz) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror(filename);
+    return -1;
+  }
+  *file_sz = get_file_size(fd); // Block devices too
+  if (*file_sz < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int my_read_ranges(const char *filename, int threads, my_range_fn fn,
+                   void *arg) {
+  off_t file_sz;
+  int fd = range_open(filename, &file_sz);
+  if (fd < 0)
+    return -1;
+  if (threads < 1)
+    threads = omp_get_max_threads();
+
+  // Range edges on chunk boundaries, so the callback sees the same chunks
+  // whatever the thread count.
+  off_t range_sz = (file_sz + threads - 1) / threads;
+  range_sz = (range_sz + RANGE_CHUNK_SZ - 1) / RANGE_CHUNK_SZ * RANGE_CHUNK_SZ;
+  if (range_sz < RANGE_CHUNK_SZ)
+    range_sz = RANGE_CHUNK_SZ;
+  int ranges = (int)((file_sz + range_sz - 1) / range_sz);
+  int failed = 0;
+
+#pragma omp parallel for num_threads(ranges > 0 ? ranges : 1)                 \
+    reduction(min : failed)
+  for (int r = 0; r < ranges; r++) {
+    struct range_worker w;
+    off_t first = (off_t)r * range_sz;
+    off_t end = first + range_sz > file_sz ? file_sz : first + range_sz;
+    if (range_worker_init(&w, fd, r, first, RANGE_CHUNK_SZ, end,
+                          RANGE_CHUNK_SZ)) {
+      failed = -ENOMEM;
+      continue;
+    }
+    range_run(&w, fn, arg);
+    if (w.err < failed)
+      failed = w.err;
+    range_worker_free(&w);
+  }
+
+  close(fd);
+  if (failed < 0) {
+    errno = -failed;
+    perror(filename);
+    return -1;
+  }
+  return 0;
+}
+
+my_range_reader *my_ropen(const char *filename, int threads) {
+  return my_ropen_ex(filename, threads, 0, 0);
+}
+
+// Ordered stream of the bytes from start to the end of the file.
+my_range_reader *my_ropen_at(const char *filename, int threads, off_t start) {
+  return my_ropen_ex(filename, threads, start, 0);
+}
+
+my_range_reader *my_ropen_ex(const char *filename, int threads, off_t start,
+                             unsigned flags) {
+  off_t file_sz;
+  int fd = range_open(filename, &file_sz);
+  if (fd < 0)
+    return NULL;
+  if (start > file_sz)
+    start = file_sz;
+  if (threads < 1)
+    threads = omp_get_max_threads();
+
+  my_range_reader *rr = new my_range_reader();
+  rr->fd = fd;
+  rr->file_sz = file_sz;
+  rr->nchunks = (file_sz - start + RANGE_CHUNK_SZ - 1) / RANGE_CHUNK_SZ;
+  rr->nworkers = rr->nchunks < threads ? (int)rr->nchunks : threads;
+  if (rr->nworkers < 1)
+    rr->nworkers = 1;
+  rr->workers = new range_worker[rr->nworkers];
+  rr->start = start;
+  if (flags & MY_RANGE_CRC32C)
+    rr->crcs = new uint32_t[rr->nchunks];
+
+  off_t stride = (off_t)rr->nworkers * RANGE_CHUNK_SZ;
+  for (int i = 0; i < rr->nworkers; i++) {
+    if (range_worker_init(&rr->workers[i], fd, i,
+                          start + (off_t)i * RANGE_CHUNK_SZ, stride, file_sz,
+                          RANGE_CHUNK_SZ)) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      rr->nworkers = i;
+      my_rclose(rr);
+      return NULL;
+    }
+    rr->workers[i].crcs = rr->crcs;
+    rr->workers[i].base = start;
+    rr->workers[i].thread = std::thread(range_run, &rr->workers[i],
+                                        (my_range_fn)NULL, (void *)NULL);
+  }
+  return rr;
+}
+
+static void range_release(my_range_reader *rr) {
+  if (!rr->held)
+    return;
+  std::lock_guard<std::mutex> guard(rr->held_worker->lock);
+  rr->held->state = SLOT_FREE;
+  rr->held_worker->cv.notify_all();
+  rr->held = NULL;
+}
+
+ssize_t my_rview(my_range_reader *rr, const char **data) {
+  range_release(rr);
+  if (rr->cur >= rr->nchunks)
+    return 0;
+
+  struct range_worker *w = &rr->workers[rr->cur % rr->nworkers];
+  long long k = rr->cur / rr->nworkers;
+  struct range_slot *sl = &w->slots[k % w->depth];
+  std::unique_lock<std::mutex> guard(w->lock);
+  while (sl->state != SLOT_READY && !w->err)
+    w->cv.wait(guard);
+  if (sl->state != SLOT_READY) {
+    errno = -w->err;
+    return -1;
+  }
+  rr->held = sl;
+  rr->held_worker = w;
+  rr->held_off = 0;
+  rr->cur++;
+  *data = sl->buf;
+  return sl->filled;
+}
+
+size_t my_rread(void *ptr, size_t size, size_t count, my_range_reader *rr) {
+  size_t total = size * count, copied = 0;
+  while (copied < total) {
+    if (!rr->held || rr->held_off == rr->held->filled) {
+      const char *data;
+      ssize_t n = my_rview(rr, &data);
+      if (n <= 0)
+        break;
+    }
+    size_t n = rr->held->filled - rr->held_off;
+    if (n > total - copied)
+      n = total - copied;
+    memcpy((char *)ptr + copied, rr->held->buf + rr->held_off, n);
+    rr->held_off += n;
+    copied += n;
+  }
+  return copied;
+}
+
+off_t my_rsize(my_range_reader *rr) { return rr->file_sz; }
+
+/*
+ * CRC32C of the whole stream, once my_rview() has returned 0. Fails if the
+ * reader was opened without MY_RANGE_CRC32C or the stream was not drained.
+ */
+int my_rcrc32c(my_range_reader *rr, uint32_t *crc) {
+  if (!rr->crcs || rr->cur < rr->nchunks) {
+    errno = EINVAL;
+    return -1;
+  }
+  uint32_t c = 0;
+  for (long long i = 0; i < rr->nchunks; i++) {
+    off_t off = rr->start + i * (off_t)RANGE_CHUNK_SZ;
+    size_t len = off + RANGE_CHUNK_SZ > rr->file_sz ? rr->file_sz - off
+                                                    : RANGE_CHUNK_SZ;
+    c = my_crc32c_combine(c, rr->crcs[i], len);
+  }
+  *crc = c;
+  return 0;
+}
+
+void my_rclose(my_range_reader *rr) {
+  if (!rr)
+    return;
+  rr->held = NULL;
+  for (int i = 0; i < rr->nworkers; i++) {
+    struct range_worker *w = &rr->workers[i];
+    {
+      std::lock_guard<std::mutex> guard(w->lock);
+      w->stop = true;
+      w->cv.notify_all();
+    }
+    if (w->thread.joinable())
+      w->thread.join();
+    range_worker_free(w);
+  }
+  delete[] rr->workers;
+  delete[] rr->crcs;
+  close(rr->fd);
+  delete rr;
+}
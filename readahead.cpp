@@ -0,0 +1,582 @@
+#include "my_io.h"
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+/*
+ * Positioned reads with adaptive read-ahead. Each read is matched against the
+ * recent streams of the file: a read that starts where a stream's last read
+ * ended is a sequential hit, one a fixed distance on from it a strided hit.
+ * Hits double the stream's read-ahead depth, and for sequential streams its
+ * chunk size; read-ahead thrown away unread halves them. Reads that match no
+ * stream are kept in a short history: one that continues an earlier read, or
+ * makes three evenly spaced with two of them, starts a stream. The rest are
+ * random and get no read-ahead at all.
+ *
+ * A file with a throttle attached holds its demand reads until the bucket has
+ * their tokens, reaping read-ahead meanwhile, and skips read-ahead it has no
+ * tokens for. With a timeout each read is linked to one, and read-ahead that
+ * timed out fails the read that wanted it.
+ */
+#define RA_STREAMS 4
+#define RA_HISTORY 8
+#define RA_SLOTS 64
+#define RA_MIN_CHUNK (16 * 1024)
+#define RA_MAX_CHUNK (1024 * 1024)
+#define RA_MAX_DEPTH 8
+#define RA_MAX_READ 0x7ffff000         // Longest read, as read(2) caps it
+#define RA_DEMAND (1ull << 32)         // user_data: a read into the caller's buffer
+#define RA_TIMER (1ull << 33)          // and the throttle's refill timer
+#define RA_CANCEL (1ull << 34)         // and my_ra_close()'s cancel
+#define RA_ALIGN(x) (((x) + BLOCK_SZ - 1) & ~(off_t)(BLOCK_SZ - 1))
+
+enum { RA_FREE, RA_INFLIGHT, RA_READY };
+
+struct ra_stream {
+  off_t last_off;
+  size_t last_len;
+  off_t stride; // 0 until two reads have been seen
+  unsigned hits;
+  unsigned depth;
+  size_t chunk;
+  int pattern;
+  unsigned long tick;
+};
+
+struct ra_slot {
+  int state;
+  off_t off;
+  size_t len; // Asked for; got once READY
+  size_t got;
+  int err;
+  char *buf;
+  size_t cap;
+  int stream;
+  bool used;
+  unsigned long tick;
+};
+
+struct ra_read {
+  off_t off;
+  size_t len;
+};
+
+struct ra_demand {
+  int res;
+  bool done;
+};
+
+struct my_readahead {
+  off_t file_sz;
+  unsigned long tick;
+  int last_pattern;
+  int last_stream;
+  ra_stream streams[RA_STREAMS];
+  ra_read history[RA_HISTORY]; // The last reads no stream matched
+  unsigned history_next;
+  ra_slot slots[RA_SLOTS];
+  ra_demand demands[RA_SLOTS + 1]; // A read has at most one gap per slot
+  my_readahead_stats stats;
+  my_throttle *throttle;
+  struct __kernel_timespec timer_ts;
+  bool timer; // In flight
+  double timeout_sec; // Of every read, 0 for none
+  struct __kernel_timespec link_ts;
+  int cancels; // In flight
+};
+
+my_readahead *my_ra_open(off_t file_sz, double timeout_sec) {
+  my_readahead *ra = static_cast<my_readahead *>(calloc(1, sizeof(*ra)));
+  if (!ra) {
+    perror("calloc");
+    return NULL;
+  }
+  ra->file_sz = file_sz;
+  ra->last_stream = -1;
+  ra->timeout_sec = timeout_sec;
+  return ra;
+}
+
+static double ra_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void ra_complete(my_readahead *ra, struct io_uring_cqe *cqe) {
+  unsigned long long ud = cqe->user_data;
+  // Reads are only cancelled by their timeout until my_ra_close().
+  int res = cqe->res == -ECANCELED ? -ETIMEDOUT : cqe->res;
+  if (ud == MY_TIMEOUT_DATA) {
+    return;
+  } else if (ud == RA_TIMER) {
+    ra->timer = false;
+  } else if (ud == RA_CANCEL) {
+    ra->cancels--;
+  } else if (ud & RA_DEMAND) {
+    ra_demand *d = &ra->demands[ud & ~RA_DEMAND];
+    d->res = res;
+    d->done = true;
+  } else {
+    ra_slot *sl = &ra->slots[ud];
+    sl->got = res > 0 ? res : 0;
+    sl->err = res < 0 ? -res : 0;
+    sl->state = RA_READY;
+  }
+}
+
+// Bound the read just queued in sqe by the file's timeout.
+static void ra_bound(my_readahead *ra, submitter *s, struct io_uring_sqe *sqe) {
+  if (ra->timeout_sec > 0)
+    app_link_timeout(s, sqe, &ra->link_ts, ra->timeout_sec, MY_TIMEOUT_DATA);
+}
+
+static int ra_wait_one(my_readahead *ra, submitter *s) {
+  struct io_uring_cqe *cqe;
+  int ret = app_wait_cqe(s, &cqe);
+  if (ret < 0) {
+    errno = -ret;
+    return -1;
+  }
+  ra_complete(ra, cqe);
+  app_cqe_seen(s);
+  return 0;
+}
+
+// Read-ahead that went unread was too deep for its stream.
+static void ra_discard(my_readahead *ra, ra_slot *sl) {
+  if (!sl->used) {
+    ra->stats.wasted_bytes += sl->got;
+    ra_stream *st = &ra->streams[sl->stream];
+    st->depth /= 2;
+    if (st->chunk > RA_MIN_CHUNK)
+      st->chunk /= 2;
+  }
+  sl->state = RA_FREE;
+}
+
+// A free slot, evicting the least recently used one that is neither in flight
+// nor part of [keep_off, keep_end).
+static ra_slot *ra_get_slot(my_readahead *ra, off_t keep_off, off_t keep_end) {
+  ra_slot *victim = NULL;
+  for (int i = 0; i < RA_SLOTS; i++) {
+    ra_slot *sl = &ra->slots[i];
+    if (sl->state == RA_FREE)
+      return sl;
+    if (sl->state == RA_READY &&
+        (sl->off + (off_t)sl->got <= keep_off || sl->off >= keep_end) &&
+        (!victim || sl->tick < victim->tick))
+      victim = sl;
+  }
+  if (victim)
+    ra_discard(ra, victim);
+  return victim;
+}
+
+static ra_slot *ra_find(my_readahead *ra, off_t off) {
+  for (int i = 0; i < RA_SLOTS; i++) {
+    ra_slot *sl = &ra->slots[i];
+    if (sl->state != RA_FREE && off >= sl->off &&
+        off < sl->off + (off_t)(sl->state == RA_READY ? sl->got : sl->len))
+      return sl;
+  }
+  return NULL;
+}
+
+// Where the next slot after off starts, or end.
+static off_t ra_next_start(my_readahead *ra, off_t off, off_t end) {
+  for (int i = 0; i < RA_SLOTS; i++) {
+    ra_slot *sl = &ra->slots[i];
+    if (sl->state != RA_FREE && sl->off > off && sl->off < end)
+      end = sl->off;
+  }
+  return end;
+}
+
+static bool ra_covered(my_readahead *ra, off_t off, size_t len) {
+  ra_slot *sl = ra_find(ra, off);
+  return sl && sl->off + (off_t)sl->len >= off + (off_t)len;
+}
+
+static int ra_issue(my_readahead *ra, my_file *mf, int stream, off_t off,
+                    size_t len, off_t keep_off, off_t keep_end) {
+  if (off >= ra->file_sz)
+    return -1;
+  if (off + (off_t)len > ra->file_sz)
+    len = ra->file_sz - off;
+  // The read being served already has its bytes accounted for.
+  if (off < keep_end && off + (off_t)len > keep_off)
+    return 0;
+  if (ra->throttle && my_throttle_take(ra->throttle, len, ra_now()) > 0)
+    return -1;
+  ra_slot *sl = ra_get_slot(ra, keep_off, keep_end);
+  if (!sl)
+    return -1;
+  if (sl->cap < len) {
+    char *buf = static_cast<char *>(realloc(sl->buf, len));
+    if (!buf)
+      return -1;
+    sl->buf = buf;
+    sl->cap = len;
+  }
+  struct io_uring_sqe *sqe = app_get_sqe(mf->s);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = 0; // The file registered by my_fopen_ex()
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->ioprio = mf->ioprio;
+  sqe->addr = (unsigned long)sl->buf;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->user_data = sl - ra->slots;
+  ra_bound(ra, mf->s, sqe);
+  sl->state = RA_INFLIGHT;
+  sl->off = off;
+  sl->len = len;
+  sl->got = 0;
+  sl->err = 0;
+  sl->stream = stream;
+  sl->used = false;
+  sl->tick = ++ra->tick;
+  ra->stats.ra_reads++;
+  ra->stats.ra_bytes += len;
+  return 0;
+}
+
+// A sequential or strided run among the reads that matched no stream.
+static int ra_detect(my_readahead *ra, off_t off, off_t *stride) {
+  for (int i = 0; i < RA_HISTORY; i++) {
+    ra_read *h = &ra->history[i];
+    if (!h->len)
+      continue;
+    if (h->off + (off_t)h->len == off)
+      return MY_RA_SEQUENTIAL;
+    off_t d = off - h->off;
+    for (int j = 0; d && j < RA_HISTORY; j++) {
+      if (j != i && ra->history[j].len && ra->history[j].off == h->off - d) {
+        *stride = d;
+        return MY_RA_STRIDED;
+      }
+    }
+  }
+  return MY_RA_RANDOM;
+}
+
+// Match a read to a stream and grow it, or start one. Returns the stream, or
+// -1 for a read that fits no pattern.
+static int ra_classify(my_readahead *ra, off_t off, size_t len) {
+  ra_stream *st = NULL, *oldest = NULL;
+  for (int i = 0; i < RA_STREAMS; i++) {
+    ra_stream *c = &ra->streams[i];
+    if (c->tick && off == c->last_off + (off_t)c->last_len) {
+      st = c;
+      st->pattern = MY_RA_SEQUENTIAL;
+      break;
+    }
+    if (c->tick && c->stride && off == c->last_off + c->stride) {
+      st = c;
+      st->pattern = MY_RA_STRIDED;
+      break;
+    }
+    if (!oldest || c->tick < oldest->tick)
+      oldest = c;
+  }
+
+  if (!st) {
+    off_t stride = 0;
+    int pattern = ra_detect(ra, off, &stride);
+    if (pattern == MY_RA_RANDOM) {
+      ra_read *h = &ra->history[ra->history_next++ % RA_HISTORY];
+      h->off = off;
+      h->len = len;
+      ra->last_pattern = MY_RA_RANDOM;
+      ra->last_stream = -1;
+      return -1;
+    }
+    st = oldest;
+    memset(st, 0, sizeof(*st));
+    st->pattern = pattern;
+    st->stride = stride;
+  }
+
+  ra->stats.pattern_hits++;
+  st->hits++;
+  st->depth = st->depth ? st->depth * 2 : 1;
+  if (st->depth > RA_MAX_DEPTH)
+    st->depth = RA_MAX_DEPTH;
+  if (st->pattern == MY_RA_SEQUENTIAL) {
+    st->chunk = st->chunk ? st->chunk * 2 : RA_ALIGN(len);
+    if (st->chunk < RA_MIN_CHUNK)
+      st->chunk = RA_MIN_CHUNK;
+    if (st->chunk > RA_MAX_CHUNK)
+      st->chunk = RA_MAX_CHUNK;
+  } else {
+    st->chunk = len;
+  }
+  st->last_off = off;
+  st->last_len = len;
+  st->tick = ++ra->tick;
+  ra->last_pattern = st->pattern;
+  ra->last_stream = st - ra->streams;
+  return ra->last_stream;
+}
+
+// Keep the stream's next depth chunks (or strides) in flight.
+static void ra_schedule(my_readahead *ra, my_file *mf, int i, off_t keep_off,
+                        off_t keep_end) {
+  if (i < 0)
+    return;
+  ra_stream *st = &ra->streams[i];
+  if (st->pattern == MY_RA_SEQUENTIAL) {
+    // Walked from the read every time: another read may have taken a slot.
+    off_t end = keep_end + (off_t)st->depth * st->chunk;
+    for (off_t pos = keep_end; pos < end && pos < ra->file_sz;) {
+      ra_slot *sl = ra_find(ra, pos);
+      if (sl) {
+        pos = sl->off + sl->len;
+        continue;
+      }
+      size_t len = ra_next_start(ra, pos, pos + st->chunk) - pos;
+      if (ra_issue(ra, mf, i, pos, len, keep_off, keep_end) < 0)
+        break;
+      pos += len;
+    }
+  } else if (st->pattern == MY_RA_STRIDED) {
+    for (unsigned k = 1; k <= st->depth; k++) {
+      off_t off = st->last_off + (off_t)k * st->stride;
+      if (off < 0 || off >= ra->file_sz)
+        break;
+      if (!ra_covered(ra, off, st->last_len) &&
+          ra_issue(ra, mf, i, off, st->last_len, keep_off, keep_end) < 0)
+        break;
+    }
+  }
+}
+
+// Wait until the throttle lets a demand read of len through. The timer's
+// io_uring_enter() also submits the gaps queued so far and reaps read-ahead.
+static int ra_throttle(my_readahead *ra, submitter *s, size_t len) {
+  double wait;
+  while (ra->throttle &&
+         (wait = my_throttle_take(ra->throttle, len, ra_now())) > 0) {
+    if (!ra->timer) {
+      if (app_prep_timeout(s, &ra->timer_ts, wait, RA_TIMER) < 0) {
+        errno = EBUSY;
+        return -1;
+      }
+      ra->timer = true;
+    }
+    while (ra->timer)
+      if (ra_wait_one(ra, s) < 0)
+        return -1;
+  }
+  return 0;
+}
+
+/*
+ * The bytes the engines that read up front hold in memory: BLOCK_SZ blocks
+ * in file order, or the mapping.
+ */
+static ssize_t pread_blocks(my_file *mf, void *buf, size_t len, off_t off) {
+  if (my_fready(mf) < 0)
+    return -1;
+  off_t file_sz = mf->fi->file_sz;
+  if (off >= file_sz)
+    return 0;
+  if (off + (off_t)len > file_sz)
+    len = file_sz - off;
+  if (mf->map) {
+    memcpy(buf, (char *)mf->map + off, len);
+    return len;
+  }
+  size_t done = 0;
+  while (done < len) {
+    struct iovc *iov = &mf->fi->iovecs[(off + done) / BLOCK_SZ];
+    size_t at = (off + done) % BLOCK_SZ;
+    size_t n = iov->buffer_size - at < len - done ? iov->buffer_size - at
+                                                  : len - done;
+    memcpy((char *)buf + done, (char *)iov->buffer + at, n);
+    done += n;
+  }
+  return len;
+}
+
+/*
+ * Read len bytes at off, like pread(2). On the engine opened with
+ * MY_FOPEN_PREAD the bytes come from read-ahead where a stream predicted
+ * them and from a read of their own otherwise; the other engines copy from
+ * what they have read already.
+ */
+ssize_t my_pread(my_file *mf, void *buf, size_t len, off_t off) {
+  my_readahead *ra = mf->ra;
+  // Every engine indexes its data by off and off + len.
+  if (off < 0 || len > SSIZE_MAX || off > LLONG_MAX - (off_t)len) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!ra)
+    return pread_blocks(mf, buf, len, off);
+  if (len > RA_MAX_READ)
+    len = RA_MAX_READ;
+  if (len == 0 || off >= ra->file_sz)
+    return 0;
+  submitter *s = mf->s;
+  off_t end = off + len;
+
+  // Gaps no slot covers are read straight into buf, alongside the read-ahead.
+  int stream = ra_classify(ra, off, len);
+  int gaps = 0;
+  for (off_t pos = off; pos < end;) {
+    ra_slot *sl = ra_find(ra, pos);
+    if (sl) {
+      sl->tick = ++ra->tick;
+      pos = sl->off + (sl->state == RA_READY ? sl->got : sl->len);
+      continue;
+    }
+    off_t next = ra_next_start(ra, pos, end);
+    if (ra_throttle(ra, s, next - pos) < 0)
+      return -1;
+    struct io_uring_sqe *sqe = app_get_sqe(s);
+    if (!sqe)
+      return -1;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = 0;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->ioprio = mf->ioprio;
+    sqe->addr = (unsigned long)((char *)buf + (pos - off));
+    sqe->len = next - pos;
+    sqe->off = pos;
+    sqe->user_data = RA_DEMAND | gaps;
+    ra_bound(ra, s, sqe);
+    ra->demands[gaps].done = false;
+    gaps++;
+    pos = next;
+  }
+  ra_schedule(ra, mf, stream, off, end);
+  // A read of its own has to be waited for anyway: submit and wait in one
+  // system call.
+  if (app_submit_and_wait(s, gaps ? 1 : 0) < 0)
+    return -1;
+
+  // Copy in file order, waiting for each piece. A short piece is the end of
+  // the file.
+  off_t pos = off;
+  int gap = 0, err = 0;
+  bool from_ra = true;
+  while (pos < end) {
+    ra_slot *sl = ra_find(ra, pos);
+    if (sl) {
+      while (sl->state == RA_INFLIGHT)
+        if (ra_wait_one(ra, s) < 0)
+          return -1;
+      if (sl->err) {
+        err = sl->err;
+        sl->state = RA_FREE; // The next read asks for it again
+        break;
+      }
+      size_t at = pos - sl->off;
+      if (at >= sl->got)
+        break;
+      size_t n = sl->got - at < (size_t)(end - pos) ? sl->got - at : end - pos;
+      memcpy((char *)buf + (pos - off), sl->buf + at, n);
+      sl->used = true;
+      pos += n;
+      // Consumed to its end: read-ahead is read once.
+      if (at + n == sl->got)
+        sl->state = RA_FREE;
+      if (sl->got < sl->len && at + n == sl->got)
+        break;
+      continue;
+    }
+    from_ra = false;
+    ra_demand *d = &ra->demands[gap++];
+    while (!d->done)
+      if (ra_wait_one(ra, s) < 0)
+        return -1;
+    if (d->res < 0) {
+      err = -d->res;
+      break;
+    }
+    off_t next = ra_next_start(ra, pos, end);
+    pos += d->res;
+    if (pos < next)
+      break;
+  }
+  // Reads past an early end of file or an error still have to land before buf
+  // is handed back.
+  for (; gap < gaps; gap++)
+    while (!ra->demands[gap].done)
+      if (ra_wait_one(ra, s) < 0)
+        return -1;
+  if (err) {
+    errno = err;
+    return -1;
+  }
+
+  ra->stats.reads++;
+  ra->stats.bytes += pos - off;
+  if (from_ra)
+    ra->stats.hits++;
+  else
+    ra->stats.misses++;
+  return pos - off;
+}
+
+/*
+ * Limit the reads my_pread() issues for mf by t, or lift the limit with NULL.
+ * Files read on the same thread may share t. Only the MY_FOPEN_PREAD engine
+ * reads after my_fopen_ex().
+ */
+int my_fthrottle(my_file *mf, my_throttle *t) {
+  if (!mf->ra) {
+    errno = EINVAL;
+    return -1;
+  }
+  mf->ra->throttle = t;
+  return 0;
+}
+
+// Read-ahead counters, with the state of the stream the last read matched.
+int my_ra_stats(my_file *mf, my_readahead_stats *st) {
+  my_readahead *ra = mf->ra;
+  if (!ra) {
+    errno = EINVAL;
+    return -1;
+  }
+  *st = ra->stats;
+  st->pattern = ra->last_pattern;
+  st->depth = ra->last_stream < 0 ? 0 : ra->streams[ra->last_stream].depth;
+  st->chunk = ra->last_stream < 0 ? 0 : ra->streams[ra->last_stream].chunk;
+  st->ring = mf->s->stats;
+  return 0;
+}
+
+// Reads in flight land in the slots, so they are cancelled, and the slots
+// freed once they and the cancel have completed.
+void my_ra_close(my_file *mf) {
+  my_readahead *ra = mf->ra;
+  if (!ra)
+    return;
+  for (int i = 0; i < RA_SLOTS; i++) {
+    if (ra->slots[i].state == RA_INFLIGHT) {
+      if (app_cancel(mf->s, 0, true, RA_CANCEL) == 0)
+        ra->cancels++;
+      break;
+    }
+  }
+  while (ra->cancels > 0)
+    if (ra_wait_one(ra, mf->s) < 0)
+      break;
+  for (int i = 0; i < RA_SLOTS; i++) {
+    while (ra->slots[i].state == RA_INFLIGHT)
+      if (ra_wait_one(ra, mf->s) < 0)
+        break;
+    free(ra->slots[i].buf);
+  }
+  free(ra);
+  mf->ra = NULL;
+}
@@ -0,0 +1,681 @@
+#include "my_io.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MY_SIMD_X86 1
+#endif
+
+/*
+ * Byte-scanning and hashing kernels shared by the line, search, counting and
+ * hashing code. Each kernel has an AVX2 (and mostly an SSE2) version picked
+ * once at run time, and a scalar fallback for other CPUs and for the tails.
+ */
+
+static const char *find_byte_scalar(const char *p, const char *end, char c) {
+  while (p < end && *p != c)
+    p++;
+  return p;
+}
+
+#ifdef MY_SIMD_X86
+__attribute__((target("sse2"))) static const char *
+find_byte_sse2(const char *p, const char *end, char c) {
+  __m128i needle = _mm_set1_epi8(c);
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+  return find_byte_scalar(p, end, c);
+}
+
+__attribute__((target("avx2"))) static const char *
+find_byte_avx2(const char *p, const char *end, char c) {
+  __m256i needle = _mm256_set1_epi8(c);
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+  return find_byte_scalar(p, end, c);
+}
+#endif
+
+static size_t count_byte_scalar(const char *p, const char *end, char c) {
+  size_t n = 0;
+  for (; p < end; p++)
+    n += *p == c;
+  return n;
+}
+
+// Lowest set bit of mask after dropping the first n - 1 of them.
+static inline unsigned nth_bit(unsigned mask, size_t n) {
+  while (--n)
+    mask &= mask - 1;
+  return __builtin_ctz(mask);
+}
+
+static const char *find_nth_byte_scalar(const char *p, const char *end,
+                                        char c, size_t *n) {
+  for (; p < end; p++)
+    if (*p == c && --*n == 0)
+      return p;
+  return end;
+}
+
+static const char *find_literal_scalar(const char *p, const char *end,
+                                       const char *pat, size_t len) {
+  for (; end - p >= (ptrdiff_t)len; p++)
+    if (*p == *pat && memcmp(p + 1, pat + 1, len - 1) == 0)
+      return p;
+  return end;
+}
+
+static inline bool is_space(unsigned char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/*
+ * wc's C-locale word rules: a space ends a word, a printable byte starts or
+ * continues one, and any other byte leaves the state alone.
+ */
+static void count_lines_words_scalar(const char *p, const char *end,
+                                     bool *in_word, size_t *lines,
+                                     size_t *words) {
+  bool w = *in_word;
+  for (; p < end; p++) {
+    unsigned char c = *p;
+    if (is_space(c)) {
+      w = false;
+    } else if (c > ' ' && c < 0x7f) {
+      *words += !w;
+      w = true;
+    }
+    *lines += c == '\n';
+  }
+  *in_word = w;
+}
+
+static size_t mismatch_scalar(const char *a, const char *b, size_t n) {
+  size_t i = 0;
+  while (i < n && a[i] == b[i])
+    i++;
+  return i;
+}
+
+// First space in [p, end), or with skip set the first byte that is not one.
+static const char *find_space_scalar(const char *p, const char *end,
+                                     bool skip) {
+  while (p < end && is_space(*p) == skip)
+    p++;
+  return p;
+}
+
+/*
+ * my_hash64() follows the shape of xxHash3's long-input loop: eight 64-bit
+ * lanes each take a 32x32->64 multiply of the input mixed with a secret, plus
+ * the raw input of the neighbouring lane, one 64-byte stripe at a time, and
+ * are scrambled after every block of HASH_STRIPES stripes. It is not
+ * bit-compatible with XXH3.
+ */
+#define HASH_STRIPE 64
+#define HASH_STRIPES 16
+#define HASH_BLOCK (HASH_STRIPE * HASH_STRIPES)
+#define HASH_PRIME32 0x9e3779b1u
+#define HASH_PRIME64_1 0x9e3779b185ebca87ull
+#define HASH_PRIME64_2 0xc2b2ae3d27d4eb4full
+
+// Stripe s is keyed by hash_secret[s..s + 8), the scramble by the last 8.
+static const uint64_t hash_secret[HASH_STRIPES + 8] = {
+    0x2cb0f69f4abea221ull, 0x9417034723148989ull, 0xdd555950609dfe03ull,
+    0xdbafb150deb12800ull, 0x7e789b2e6c442cb6ull, 0xf41e5636c7e4f8c4ull,
+    0x0959d150f8fba7e4ull, 0xa97316f13cdb9eeaull, 0x74cd8258f9520068ull,
+    0x55c74a62e116868bull, 0xd2f4c799a2023cbdull, 0xdf98cb79a37b51b9ull,
+    0x396f5885524f3905ull, 0xaf1d56386ca3b276ull, 0xa9ffbe6b5104e85aull,
+    0x6bd0c51b9fd533b3ull, 0x980ce91c50ab4b56ull, 0x28ac395780fe62c5ull,
+    0x768912e3a6bcedc7ull, 0x50b3e8c9332c7c88ull, 0xce3bbfe520bd47daull,
+    0xcba6c8e8e0bb7c4full, 0xbf194db8434a346dull, 0x7d8f2a7b60416d7full,
+};
+
+static inline uint64_t read64(const char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline void hash_stripe(uint64_t *acc, const char *p,
+                               const uint64_t *key) {
+  for (int i = 0; i < 8; i++) {
+    uint64_t data = read64(p + 8 * i);
+    uint64_t k = data ^ key[i];
+    acc[i ^ 1] += data;
+    acc[i] += (k & 0xffffffffu) * (k >> 32);
+  }
+}
+
+static void hash_blocks_scalar(uint64_t *acc, const char *p, size_t n) {
+  for (; n > 0; n--, p += HASH_BLOCK) {
+    for (int s = 0; s < HASH_STRIPES; s++)
+      hash_stripe(acc, p + s * HASH_STRIPE, hash_secret + s);
+    for (int i = 0; i < 8; i++) {
+      acc[i] ^= acc[i] >> 47;
+      acc[i] ^= hash_secret[HASH_STRIPES + i];
+      acc[i] *= HASH_PRIME32;
+    }
+  }
+}
+
+/*
+ * CRC32C (Castagnoli, reflected polynomial 0x82f63b78). Without SSE4.2 the
+ * register is advanced eight bytes per step through eight lookup tables.
+ */
+#define CRC32C_POLY 0x82f63b78u
+
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_init_table() {
+  for (int i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+    crc32c_table[0][i] = c;
+  }
+  for (int t = 1; t < 8; t++)
+    for (int i = 0; i < 256; i++) {
+      uint32_t c = crc32c_table[t - 1][i];
+      crc32c_table[t][i] = (c >> 8) ^ crc32c_table[0][c & 0xff];
+    }
+}
+
+static uint32_t crc32c_scalar(uint32_t crc, const char *p, size_t len) {
+  const uint32_t(*t)[256] = crc32c_table;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t v = read64(p) ^ crc;
+    crc = t[7][v & 0xff] ^ t[6][(v >> 8) & 0xff] ^ t[5][(v >> 16) & 0xff] ^
+          t[4][(v >> 24) & 0xff] ^ t[3][(v >> 32) & 0xff] ^
+          t[2][(v >> 40) & 0xff] ^ t[1][(v >> 48) & 0xff] ^ t[0][v >> 56];
+  }
+  for (; len > 0; len--)
+    crc = (crc >> 8) ^ t[0][(crc ^ (unsigned char)*p++) & 0xff];
+  return crc;
+}
+
+#ifdef MY_SIMD_X86
+__attribute__((target("sse2"))) static size_t
+mismatch_sse2(const char *a, const char *b, size_t n) {
+  size_t i = 0;
+  for (; n - i >= 16; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    unsigned same = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+    if (same != 0xffffu)
+      return i + __builtin_ctz(~same);
+  }
+  return i + mismatch_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) static size_t
+mismatch_avx2(const char *a, const char *b, size_t n) {
+  size_t i = 0;
+  for (; n - i >= 32; i += 32) {
+    __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+    unsigned same = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+    if (same != 0xffffffffu)
+      return i + __builtin_ctz(~same);
+  }
+  return i + mismatch_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2"))) static const char *
+find_space_sse2(const char *p, const char *end, bool skip) {
+  const __m128i sp = _mm_set1_epi8(' ');
+  const __m128i ctl_lo = _mm_set1_epi8('\t' - 1);
+  const __m128i ctl_hi = _mm_set1_epi8('\r' + 1);
+  unsigned flip = skip ? 0xffffu : 0;
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i ctl = _mm_and_si128(_mm_cmpgt_epi8(v, ctl_lo),
+                                _mm_cmpgt_epi8(ctl_hi, v));
+    unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, sp), ctl));
+    if ((mask ^= flip))
+      return p + __builtin_ctz(mask);
+  }
+  return find_space_scalar(p, end, skip);
+}
+
+__attribute__((target("avx2"))) static const char *
+find_space_avx2(const char *p, const char *end, bool skip) {
+  const __m256i sp = _mm256_set1_epi8(' ');
+  const __m256i ctl_lo = _mm256_set1_epi8('\t' - 1);
+  const __m256i ctl_hi = _mm256_set1_epi8('\r' + 1);
+  unsigned flip = skip ? 0xffffffffu : 0;
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i ctl = _mm256_and_si256(_mm256_cmpgt_epi8(v, ctl_lo),
+                                   _mm256_cmpgt_epi8(ctl_hi, v));
+    unsigned mask = _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, sp), ctl));
+    if ((mask ^= flip))
+      return p + __builtin_ctz(mask);
+  }
+  return find_space_scalar(p, end, skip);
+}
+
+// The same blocks, four lanes to a register.
+__attribute__((target("avx2"))) static void
+hash_blocks_avx2(uint64_t *acc, const char *p, size_t n) {
+  const __m256i prime = _mm256_set1_epi64x(HASH_PRIME32);
+  __m256i a[2] = {_mm256_loadu_si256((const __m256i *)acc),
+                  _mm256_loadu_si256((const __m256i *)(acc + 4))};
+
+  for (; n > 0; n--, p += HASH_BLOCK) {
+    for (int s = 0; s < HASH_STRIPES; s++)
+      for (int h = 0; h < 2; h++) {
+        __m256i data = _mm256_loadu_si256(
+            (const __m256i *)(p + s * HASH_STRIPE + 32 * h));
+        __m256i key = _mm256_xor_si256(
+            data, _mm256_loadu_si256(
+                      (const __m256i *)(hash_secret + s + 4 * h)));
+        __m256i prod = _mm256_mul_epu32(key, _mm256_srli_epi64(key, 32));
+        __m256i swap = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        a[h] = _mm256_add_epi64(a[h], _mm256_add_epi64(prod, swap));
+      }
+    for (int h = 0; h < 2; h++) {
+      __m256i v = _mm256_xor_si256(a[h], _mm256_srli_epi64(a[h], 47));
+      v = _mm256_xor_si256(
+          v, _mm256_loadu_si256(
+                 (const __m256i *)(hash_secret + HASH_STRIPES + 4 * h)));
+      // 64x32-bit multiply from two 32x32->64 halves.
+      __m256i lo = _mm256_mul_epu32(v, prime);
+      __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(v, 32), prime);
+      a[h] = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+    }
+  }
+  _mm256_storeu_si256((__m256i *)acc, a[0]);
+  _mm256_storeu_si256((__m256i *)(acc + 4), a[1]);
+}
+
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const char *p, size_t len) {
+  uint64_t c = crc;
+  for (; len >= 8; p += 8, len -= 8)
+    c = _mm_crc32_u64(c, read64(p));
+  crc = (uint32_t)c;
+  for (; len > 0; len--)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+
+/*
+ * 32 bytes at a time: masks of spaces and printable bytes, word starts where
+ * a printable byte follows a space, and the newline mask, each reduced with
+ * popcount. Blocks holding other bytes, which are transparent to the word
+ * state, go through the scalar loop.
+ */
+__attribute__((target("avx2,popcnt"))) static void
+count_lines_words_avx2(const char *p, const char *end, bool *in_word,
+                       size_t *lines, size_t *words) {
+  const __m256i sp = _mm256_set1_epi8(' ');
+  const __m256i nl = _mm256_set1_epi8('\n');
+  const __m256i ctl_lo = _mm256_set1_epi8('\t' - 1);
+  const __m256i ctl_hi = _mm256_set1_epi8('\r' + 1);
+  const __m256i del = _mm256_set1_epi8(0x7f);
+  unsigned carry = *in_word ? 0 : 1; // Was the last byte that counted a space?
+  size_t l = 0, w = 0;
+
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i ctl = _mm256_and_si256(_mm256_cmpgt_epi8(v, ctl_lo),
+                                   _mm256_cmpgt_epi8(ctl_hi, v));
+    unsigned space = _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, sp), ctl));
+    unsigned print = _mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpgt_epi8(v, sp), _mm256_cmpgt_epi8(del, v)));
+    l += __builtin_popcount(
+        (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)));
+
+    if ((space | print) != 0xffffffffu) {
+      bool in = !carry;
+      size_t ignored = 0;
+      count_lines_words_scalar(p, p + 32, &in, &ignored, &w);
+      carry = !in;
+      continue;
+    }
+    w += __builtin_popcount(print & ((space << 1) | carry));
+    carry = space >> 31;
+  }
+  *lines += l;
+  *words += w;
+  *in_word = !carry;
+  count_lines_words_scalar(p, end, in_word, lines, words);
+}
+
+/*
+ * Compare 32 candidate positions at once against the pattern's first and
+ * last bytes; only positions where both agree get a memcmp of the middle.
+ */
+__attribute__((target("avx2"))) static const char *
+find_literal_avx2(const char *p, const char *end, const char *pat,
+                  size_t len) {
+  __m256i first = _mm256_set1_epi8(pat[0]);
+  __m256i last = _mm256_set1_epi8(pat[len - 1]);
+  for (; end - p >= (ptrdiff_t)(len - 1 + 32); p += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)p);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(p + len - 1));
+    unsigned mask = _mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                         _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      unsigned bit = __builtin_ctz(mask);
+      if (memcmp(p + bit + 1, pat + 1, len - 2) == 0)
+        return p + bit;
+      mask &= mask - 1;
+    }
+  }
+  return find_literal_scalar(p, end, pat, len);
+}
+
+__attribute__((target("sse2"))) static const char *
+find_literal_sse2(const char *p, const char *end, const char *pat,
+                  size_t len) {
+  __m128i first = _mm_set1_epi8(pat[0]);
+  __m128i last = _mm_set1_epi8(pat[len - 1]);
+  for (; end - p >= (ptrdiff_t)(len - 1 + 16); p += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + len - 1));
+    unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      unsigned bit = __builtin_ctz(mask);
+      if (memcmp(p + bit + 1, pat + 1, len - 2) == 0)
+        return p + bit;
+      mask &= mask - 1;
+    }
+  }
+  return find_literal_scalar(p, end, pat, len);
+}
+
+__attribute__((target("sse2,popcnt"))) static size_t
+count_byte_sse2(const char *p, const char *end, char c) {
+  __m128i needle = _mm_set1_epi8(c);
+  size_t n = 0;
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle)));
+  }
+  return n + count_byte_scalar(p, end, c);
+}
+
+__attribute__((target("avx2,popcnt"))) static size_t
+count_byte_avx2(const char *p, const char *end, char c) {
+  __m256i needle = _mm256_set1_epi8(c);
+  size_t n = 0;
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    n += __builtin_popcount(
+        (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle)));
+  }
+  return n + count_byte_scalar(p, end, c);
+}
+
+__attribute__((target("sse2,popcnt"))) static const char *
+find_nth_byte_sse2(const char *p, const char *end, char c, size_t *n) {
+  __m128i needle = _mm_set1_epi8(c);
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+    size_t hits = __builtin_popcount(mask);
+    if (hits >= *n) {
+      unsigned bit = nth_bit(mask, *n);
+      *n = 0;
+      return p + bit;
+    }
+    *n -= hits;
+  }
+  return find_nth_byte_scalar(p, end, c, n);
+}
+
+__attribute__((target("avx2,popcnt"))) static const char *
+find_nth_byte_avx2(const char *p, const char *end, char c, size_t *n) {
+  __m256i needle = _mm256_set1_epi8(c);
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+    size_t hits = __builtin_popcount(mask);
+    if (hits >= *n) {
+      unsigned bit = nth_bit(mask, *n);
+      *n = 0;
+      return p + bit;
+    }
+    *n -= hits;
+  }
+  return find_nth_byte_scalar(p, end, c, n);
+}
+#endif
+
+typedef const char *(*find_byte_fn)(const char *, const char *, char);
+typedef size_t (*count_byte_fn)(const char *, const char *, char);
+typedef const char *(*find_nth_byte_fn)(const char *, const char *, char,
+                                        size_t *);
+typedef const char *(*find_literal_fn)(const char *, const char *,
+                                       const char *, size_t);
+typedef void (*count_lines_words_fn)(const char *, const char *, bool *,
+                                     size_t *, size_t *);
+typedef const char *(*find_space_fn)(const char *, const char *, bool);
+typedef size_t (*mismatch_fn)(const char *, const char *, size_t);
+typedef void (*hash_blocks_fn)(uint64_t *, const char *, size_t);
+typedef uint32_t (*crc32c_fn)(uint32_t, const char *, size_t);
+
+static bool has_avx2() {
+#ifdef MY_SIMD_X86
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+#else
+  return false;
+#endif
+}
+
+static bool has_sse2() {
+#ifdef MY_SIMD_X86
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt");
+#else
+  return false;
+#endif
+}
+
+static find_byte_fn pick_find_byte() {
+#ifdef MY_SIMD_X86
+  if (has_avx2())
+    return find_byte_avx2;
+  if (has_sse2())
+    return find_byte_sse2;
+#endif
+  return find_byte_scalar;
+}
+
+static count_byte_fn pick_count_byte() {
+#ifdef MY_SIMD_X86
+  if (has_avx2())
+    return count_byte_avx2;
+  if (has_sse2())
+    return count_byte_sse2;
+#endif
+  return count_byte_scalar;
+}
+
+static find_nth_byte_fn pick_find_nth_byte() {
+#ifdef MY_SIMD_X86
+  if (has_avx2())
+    return find_nth_byte_avx2;
+  if (has_sse2())
+    return find_nth_byte_sse2;
+#endif
+  return find_nth_byte_scalar;
+}
+
+static find_literal_fn pick_find_literal() {
+#ifdef MY_SIMD_X86
+  if (has_avx2())
+    return find_literal_avx2;
+  if (has_sse2())
+    return find_literal_sse2;
+#endif
+  return find_literal_scalar;
+}
+
+static count_lines_words_fn pick_count_lines_words() {
+#ifdef MY_SIMD_X86
+  if (has_avx2())
+    return count_lines_words_avx2;
+#endif
+  return count_lines_words_scalar;
+}
+
+static find_space_fn pick_find_space() {
+#ifdef MY_SIMD_X86
+  if (has_avx2())
+    return find_space_avx2;
+  if (has_sse2())
+    return find_space_sse2;
+#endif
+  return find_space_scalar;
+}
+
+static mismatch_fn pick_mismatch() {
+#ifdef MY_SIMD_X86
+  if (has_avx2())
+    return mismatch_avx2;
+  if (has_sse2())
+    return mismatch_sse2;
+#endif
+  return mismatch_scalar;
+}
+
+static hash_blocks_fn pick_hash_blocks() {
+#ifdef MY_SIMD_X86
+  if (has_avx2())
+    return hash_blocks_avx2;
+#endif
+  return hash_blocks_scalar;
+}
+
+static crc32c_fn pick_crc32c() {
+#ifdef MY_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2"))
+    return crc32c_sse42;
+#endif
+  crc32c_init_table();
+  return crc32c_scalar;
+}
+
+// First occurrence of c in [p, end), or end.
+const char *my_find_byte(const char *p, const char *end, char c) {
+  static const find_byte_fn fn = pick_find_byte();
+  return fn(p, end, c);
+}
+
+// Occurrences of c in [p, end).
+size_t my_count_byte(const char *p, const char *end, char c) {
+  static const count_byte_fn fn = pick_count_byte();
+  return fn(p, end, c);
+}
+
+/*
+ * The *n-th occurrence of c in [p, end) (*n >= 1). Returns end if there are
+ * fewer, with *n reduced by the number seen, so a scan can carry on in the
+ * next buffer.
+ */
+const char *my_find_nth_byte(const char *p, const char *end, char c,
+                             size_t *n) {
+  static const find_nth_byte_fn fn = pick_find_nth_byte();
+  return fn(p, end, c, n);
+}
+
+// First occurrence of pat[0..len) in [p, end), or end.
+const char *my_find_literal(const char *p, const char *end, const char *pat,
+                            size_t len) {
+  static const find_literal_fn fn = pick_find_literal();
+  if (len == 0)
+    return p;
+  if (len == 1)
+    return my_find_byte(p, end, *pat);
+  return fn(p, end, pat, len);
+}
+
+/*
+ * Add the newlines and word starts in [p, end) to *lines and *words.
+ * *in_word carries whether the byte before p was part of a word.
+ */
+void my_count_lines_words(const char *p, const char *end, bool *in_word,
+                          size_t *lines, size_t *words) {
+  static const count_lines_words_fn fn = pick_count_lines_words();
+  fn(p, end, in_word, lines, words);
+}
+
+// First whitespace byte (' ', '\t' to '\r') in [p, end), or end.
+const char *my_find_space(const char *p, const char *end) {
+  static const find_space_fn fn = pick_find_space();
+  return fn(p, end, false);
+}
+
+// First byte in [p, end) that is not whitespace, or end.
+const char *my_skip_space(const char *p, const char *end) {
+  static const find_space_fn fn = pick_find_space();
+  return fn(p, end, true);
+}
+
+// Index of the first byte where a[0..n) and b[0..n) differ, or n.
+size_t my_mismatch(const char *a, const char *b, size_t n) {
+  static const mismatch_fn fn = pick_mismatch();
+  return fn(a, b, n);
+}
+
+static inline uint64_t hash_fold(uint64_t a, uint64_t b) {
+  unsigned __int128 m = (unsigned __int128)a * b;
+  return (uint64_t)m ^ (uint64_t)(m >> 64);
+}
+
+// 64-bit non-cryptographic hash of data[0..len).
+uint64_t my_hash64(const void *data, size_t len, uint64_t seed) {
+  static const hash_blocks_fn fn = pick_hash_blocks();
+  const char *p = static_cast<const char *>(data);
+  uint64_t acc[8] = {HASH_PRIME32,   HASH_PRIME64_1, HASH_PRIME64_2,
+                     HASH_PRIME64_1, HASH_PRIME64_2, HASH_PRIME32,
+                     HASH_PRIME64_2, HASH_PRIME64_1};
+  for (int i = 0; i < 8; i++)
+    acc[i] += i & 1 ? -seed : seed;
+
+  size_t blocks = len / HASH_BLOCK;
+  fn(acc, p, blocks);
+  p += blocks * HASH_BLOCK;
+  size_t left = len % HASH_BLOCK;
+  int s = 0;
+  for (; left >= HASH_STRIPE; left -= HASH_STRIPE, p += HASH_STRIPE)
+    hash_stripe(acc, p, hash_secret + s++);
+  // The last partial stripe, zero padded; the length below tells it apart.
+  char last[HASH_STRIPE] = {0};
+  memcpy(last, p, left);
+  hash_stripe(acc, last, hash_secret + s);
+
+  uint64_t h = len * HASH_PRIME64_1;
+  for (int i = 0; i < 4; i++)
+    h += hash_fold(acc[2 * i] ^ hash_secret[2 * i],
+                   acc[2 * i + 1] ^ hash_secret[2 * i + 1]);
+  h ^= h >> 37;
+  h *= HASH_PRIME64_2;
+  return h ^ (h >> 32);
+}
+
+// CRC32C of data[0..len), continuing from crc (0 for a fresh checksum).
+uint32_t my_crc32c(uint32_t crc, const void *data, size_t len) {
+  static const crc32c_fn fn = pick_crc32c();
+  return ~fn(~crc, static_cast<const char *>(data), len);
+}
@@ -0,0 +1,74 @@
+#include "my_io.h"
+
+/*
+ * Token buckets for bandwidth and IOPS limits. A read takes one I/O token and
+ * a token per byte; the buckets fill at the configured rates and hold up to
+ * THROTTLE_BURST seconds' worth. The byte bucket may go into debt, so a read
+ * bigger than the burst still goes through once the bucket is full and the
+ * next read waits the debt off. A rate of 0 does not limit.
+ *
+ * Nothing sleeps here: the caller of a throttled read arms an
+ * IORING_OP_TIMEOUT for the wait on its own ring, so the refill wakes the
+ * same io_uring_enter() that reaps its reads.
+ */
+#define THROTTLE_BURST 0.05
+#define THROTTLE_MAX_WAIT 0.05 // Longest timer, so new limits are seen soon
+
+void my_throttle_init(my_throttle *t, double bytes_per_sec, double iops) {
+  *t = my_throttle();
+  my_throttle_set(t, bytes_per_sec, iops);
+  t->bytes = t->bytes_per_sec * THROTTLE_BURST;
+  t->ios = t->iops * THROTTLE_BURST > 1 ? t->iops * THROTTLE_BURST : 1;
+}
+
+// New limits, taking effect from the next read. Tokens over the new burst are
+// dropped.
+void my_throttle_set(my_throttle *t, double bytes_per_sec, double iops) {
+  t->bytes_per_sec = bytes_per_sec > 0 ? bytes_per_sec : 0;
+  t->iops = iops > 0 ? iops : 0;
+  if (t->bytes > t->bytes_per_sec * THROTTLE_BURST)
+    t->bytes = t->bytes_per_sec * THROTTLE_BURST;
+  double ios = t->iops * THROTTLE_BURST > 1 ? t->iops * THROTTLE_BURST : 1;
+  if (t->ios > ios)
+    t->ios = ios;
+}
+
+static void throttle_refill(my_throttle *t, double now) {
+  double dt = t->last ? now - t->last : 0;
+  t->last = now;
+  if (dt <= 0)
+    return;
+  double bytes = t->bytes + t->bytes_per_sec * dt;
+  double cap = t->bytes_per_sec * THROTTLE_BURST;
+  t->bytes = bytes < cap ? bytes : cap;
+  double ios = t->ios + t->iops * dt;
+  cap = t->iops * THROTTLE_BURST > 1 ? t->iops * THROTTLE_BURST : 1;
+  t->ios = ios < cap ? ios : cap;
+}
+
+/*
+ * Take the tokens for a read of bytes at time now. Returns 0 when it may be
+ * issued, or else the seconds to wait before asking again, with nothing
+ * taken.
+ */
+double my_throttle_take(my_throttle *t, size_t bytes, double now) {
+  if (!t->bytes_per_sec && !t->iops)
+    return 0;
+  throttle_refill(t, now);
+  double wait = 0;
+  if (t->bytes_per_sec && t->bytes < 0)
+    wait = -t->bytes / t->bytes_per_sec;
+  if (t->iops && t->ios < 1 && (1 - t->ios) / t->iops > wait)
+    wait = (1 - t->ios) / t->iops;
+  if (wait > 0) {
+    t->waits++;
+    return wait < THROTTLE_MAX_WAIT ? wait : THROTTLE_MAX_WAIT;
+  }
+  if (t->bytes_per_sec)
+    t->bytes -= bytes;
+  if (t->iops)
+    t->ios -= 1;
+  t->reads++;
+  t->read_bytes += bytes;
+  return 0;
+}